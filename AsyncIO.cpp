@@ -0,0 +1,487 @@
+
+#include "StdAfx.h"
+#include "AsyncIO.h"
+#include "Save.h"
+
+#if OL_HAS_IO_URING
+#include <liburing.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+static DEFINE_CVAR(int, kAsyncIOThreads, 2);
+static DEFINE_CVAR(int, kAsyncIOQueueDepth, 64);
+
+static void AIO_Report(const char* format, ...)
+{
+    va_list vl;
+    va_start(vl, format);
+    Report("[AIO] " + str_vformat(format, vl));
+    va_end(vl);
+}
+
+#if OL_HAS_IO_URING
+
+// a raw read or write in flight in the ring
+struct UringOp {
+    int             fd    = -1;
+    bool            write = false;
+    string          name;           // save name passed to AIO_SaveFileRaw, for endSave
+    string          path;           // absolute destination / source
+    string          tmp;            // write to here, then rename to path
+    string          data;
+    size_t          done  = 0;
+    AIOLoadCallback lcb;
+    AIOSaveCallback scb;
+};
+
+#endif
+
+struct AsyncIO {
+    typedef std::function<void()> Job;
+
+    std::mutex              mutex;
+    std::condition_variable jobCond;
+    std::condition_variable doneCond;
+    std::deque<Job>         jobs;
+    std::deque<Job>         completed;  // callbacks waiting for AIO_Poll
+    std::vector<std::thread> threads;
+    std::unordered_map<string, std::deque<Job>> saving; // file name -> saves queued behind the one in flight
+    int                     pending = 0;
+    int                     waiting = 0;  // saves sitting in saving queues
+    bool                    started = false;
+    bool                    quit    = false;
+
+#if OL_HAS_IO_URING
+    std::mutex              ringMutex;  // guards sqe submission
+    io_uring                ring;
+    bool                    ringOk = false;
+    std::thread             reaper;
+#endif
+
+    static AsyncIO &instance()
+    {
+        static AsyncIO *aio = new AsyncIO;
+        return *aio;
+    }
+
+    void start()
+    {
+        // mutex held
+        if (started)
+            return;
+        started = true;
+        quit = false;
+        for (int i=0; i<max(1, (int)kAsyncIOThreads); i++)
+            threads.emplace_back([this]() { workerLoop(); });
+
+#if OL_HAS_IO_URING
+        const int err = io_uring_queue_init(max(8, (int)kAsyncIOQueueDepth), &ring, 0);
+        ringOk = (err == 0);
+        if (ringOk)
+            reaper = std::thread([this]() { reaperLoop(); });
+        else
+            AIO_Report("io_uring_queue_init failed, using thread pool: %s", strerror(-err));
+#endif
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            if (!started)
+                return;
+            quit = true;
+        }
+        jobCond.notify_all();
+        for (std::thread &th : threads)
+            th.join();
+        threads.clear();
+
+#if OL_HAS_IO_URING
+        if (ringOk)
+        {
+            {
+                // NULL user data wakes the reaper to exit
+                std::lock_guard<std::mutex> l(ringMutex);
+                io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+                io_uring_prep_nop(sqe);
+                io_uring_sqe_set_data(sqe, NULL);
+                io_uring_submit(&ring);
+            }
+            reaper.join();
+            io_uring_queue_exit(&ring);
+            ringOk = false;
+        }
+#endif
+        std::lock_guard<std::mutex> l(mutex);
+        started = false;
+    }
+
+    // run JOB on a worker thread. JOB must call complete() exactly once
+    void submit(Job &&job)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            start();
+            pending++;
+            jobs.push_back(std::move(job));
+        }
+        jobCond.notify_one();
+    }
+
+    // run START now, or once earlier saves to FNAME finish. Saves to the same file write the
+    // same temp file, so they must not overlap. START must make sure endSave(FNAME) is called
+    // when its write is done, before queueing the completion callback
+    void beginSave(const string &fname, Job &&start)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            auto it = saving.find(fname);
+            if (it != saving.end())
+            {
+                it->second.push_back(std::move(start));
+                waiting++;
+                return;
+            }
+            saving[fname];
+        }
+        start();
+    }
+
+    void endSave(const string &fname)
+    {
+        Job next;
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            auto it = saving.find(fname);
+            if (it == saving.end())
+                return;
+            if (it->second.empty())
+            {
+                saving.erase(it);
+                return;
+            }
+            next = std::move(it->second.front());
+            it->second.pop_front();
+            waiting--;          // the caller has not completed yet, so pending stays nonzero
+        }
+        next();
+    }
+
+    // queue callback for AIO_Poll
+    void complete(Job &&cb)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            completed.push_back(std::move(cb));
+            pending--;
+        }
+        doneCond.notify_all();
+    }
+
+    void workerLoop()
+    {
+        thread_setup("AsyncIO");
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> l(mutex);
+                jobCond.wait(l, [this]() { return quit || !jobs.empty(); });
+                if (jobs.empty())
+                    break;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+            OL_ThreadEndIteration();
+        }
+        thread_cleanup();
+    }
+
+    int poll()
+    {
+        std::deque<Job> cbs;
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            cbs.swap(completed);
+        }
+        for (Job &cb : cbs)
+            cb();
+        return cbs.size();
+    }
+
+    void flush()
+    {
+        {
+            std::unique_lock<std::mutex> l(mutex);
+            doneCond.wait(l, [this]() { return pending == 0 && waiting == 0; });
+        }
+        poll();
+    }
+
+#if OL_HAS_IO_URING
+
+    bool useRing()
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        start();
+        return ringOk;
+    }
+
+    // ringMutex held
+    void prepOp(UringOp *op)
+    {
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        while (!sqe) {
+            io_uring_submit(&ring);  // queue full
+            sqe = io_uring_get_sqe(&ring);
+        }
+        char* ptr = &op->data[op->done];
+        const uint len = (uint)min(op->data.size() - op->done, (size_t)1<<30);
+        if (op->write)
+            io_uring_prep_write(sqe, op->fd, ptr, len, op->done);
+        else
+            io_uring_prep_read(sqe, op->fd, ptr, len, op->done);
+        io_uring_sqe_set_data(sqe, op);
+    }
+
+    void submitOp(UringOp *op)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            pending++;
+        }
+        std::lock_guard<std::mutex> l(ringMutex);
+        prepOp(op);
+        io_uring_submit(&ring);
+    }
+
+    void finishOp(UringOp *op, int res)
+    {
+        bool success = (res >= 0);
+        if (!success)
+            AIO_Report("%s '%s' failed: %s", op->write ? "write" : "read",
+                       op->write ? op->tmp.c_str() : op->path.c_str(), strerror(-res));
+        if (close(op->fd) && success) {
+            AIO_Report("close '%s' failed: %s", op->path.c_str(), strerror(errno));
+            success = false;
+        }
+        if (op->write && success && rename(op->tmp.c_str(), op->path.c_str())) {
+            AIO_Report("error renaming temp file from '%s' to '%s': %s'",
+                       op->tmp.c_str(), op->path.c_str(), strerror(errno));
+            success = false;
+        }
+        if (op->write) {
+            DPRINT(SAVE, ("save raw %s %d bytes (async)", op->path.c_str(), (int)op->data.size()));
+            endSave(op->name);
+        } else {
+            DPRINT(SAVE, ("load raw %s %d bytes (async)", op->path.c_str(), (int)op->data.size()));
+        }
+
+        complete([op, success]() {
+                if (op->lcb)
+                    op->lcb(success, success ? std::move(op->data) : string());
+                else if (op->scb)
+                    op->scb(success);
+                delete op;
+            });
+    }
+
+    void reaperLoop()
+    {
+        thread_setup("AsyncIO Ring");
+        for (;;)
+        {
+            io_uring_cqe *cqe = NULL;
+            const int err = io_uring_wait_cqe(&ring, &cqe);
+            if (err == -EINTR)
+                continue;
+            if (err < 0) {
+                AIO_Report("io_uring_wait_cqe failed: %s", strerror(-err));
+                break;
+            }
+            UringOp *op = (UringOp*) io_uring_cqe_get_data(cqe);
+            const int res = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            if (!op)
+                break;
+
+            if (res > 0 && op->done + res < op->data.size())
+            {
+                // short read or write, continue where it left off
+                op->done += res;
+                std::lock_guard<std::mutex> l(ringMutex);
+                prepOp(op);
+                io_uring_submit(&ring);
+                continue;
+            }
+            if (res == 0 && !op->write)
+                op->data.resize(op->done); // file shrank
+            finishOp(op, (res == 0 && op->write) ? -EIO : res);
+        }
+        thread_cleanup();
+    }
+
+    bool ringLoad(const string &fname, AIOLoadCallback &cb)
+    {
+        if (!useRing())
+            return false;
+        const char* path = OL_PathForFile(fname.c_str(), "r");
+        const int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+            if (fd >= 0)
+                close(fd);
+            return false;       // let the thread pool report errors
+        }
+        UringOp *op = new UringOp;
+        op->fd   = fd;
+        op->path = path;
+        op->data.resize(st.st_size);
+        op->lcb  = std::move(cb);
+        submitOp(op);
+        return true;
+    }
+
+    bool ringSave(const string &fname, string &data, AIOSaveCallback &cb)
+    {
+        if (data.empty() || !useRing())
+            return false;
+        const char* path = OL_PathForFile(fname.c_str(), "w");
+        OL_CreateParentDirs(path);
+        const string tmp = string(path) + ".b";
+        const int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        UringOp *op = new UringOp;
+        op->fd    = fd;
+        op->write = true;
+        op->name  = fname;
+        op->path  = path;
+        op->tmp   = tmp;
+        op->data  = std::move(data);
+        op->scb   = std::move(cb);
+        submitOp(op);
+        return true;
+    }
+
+#endif
+};
+
+// run SAVE on the pool. The caller holds FNAME's save slot (beginSave)
+static void runSave(const string &fname, const std::function<bool()> &save, const AIOSaveCallback &cb)
+{
+    AsyncIO &aio = AsyncIO::instance();
+    aio.submit([&aio, fname, save, cb]() {
+            const bool success = save();
+            aio.endSave(fname);
+            aio.complete([cb, success]() {
+                    if (cb)
+                        cb(success);
+                });
+        });
+}
+
+static void submitSave(const string &fname, std::function<bool()> &&save, AIOSaveCallback &&cb)
+{
+    AsyncIO::instance().beginSave(fname, [fname, save, cb]() { runSave(fname, save, cb); });
+}
+
+static void submitLoad(std::function<string()> &&load, AIOLoadCallback &&cb)
+{
+    AsyncIO &aio = AsyncIO::instance();
+    aio.submit([&aio, load, cb]() {
+            // shared_ptr because std::function must be copyable
+            std::shared_ptr<string> data = std::make_shared<string>(load());
+            aio.complete([cb, data]() {
+                    if (cb)
+                        cb(data->size() != 0, std::move(*data));
+                });
+        });
+}
+
+void AIO_SaveFile(const string &fname, string data, AIOSaveCallback cb)
+{
+    std::shared_ptr<string> dat = std::make_shared<string>(std::move(data));
+    submitSave(fname, [fname, dat]() { return SaveFile(fname, *dat); }, std::move(cb));
+}
+
+void AIO_SaveCompressedFile(const string &fname, string data, AIOSaveCallback cb)
+{
+    std::shared_ptr<string> dat = std::make_shared<string>(std::move(data));
+    submitSave(fname, [fname, dat]() { return SaveCompressedFile(fname, *dat); }, std::move(cb));
+}
+
+void AIO_LoadFile(const string &fname, AIOLoadCallback cb)
+{
+    submitLoad([fname]() { return LoadFile(fname); }, std::move(cb));
+}
+
+void AIO_SaveFileRaw(const string &fname, string data, AIOSaveCallback cb)
+{
+    std::shared_ptr<string> dat = std::make_shared<string>(std::move(data));
+    AsyncIO::instance().beginSave(fname, [fname, dat, cb]() {
+#if OL_HAS_IO_URING
+            AIOSaveCallback rcb = cb;
+            if (AsyncIO::instance().ringSave(fname, *dat, rcb))
+                return;
+#endif
+            runSave(fname, [fname, dat]() { return ZF_SaveFileRaw(fname.c_str(), *dat); }, cb);
+        });
+}
+
+void AIO_LoadFileRaw(const string &fname, AIOLoadCallback cb)
+{
+#if OL_HAS_IO_URING
+    if (AsyncIO::instance().ringLoad(fname, cb))
+        return;
+#endif
+    submitLoad([fname]() { return ZF_LoadFileRaw(fname.c_str()); }, std::move(cb));
+}
+
+void AIO_SaveImage(const OutlawImage &img, const string &fname, bool flip, AIOSaveCallback cb)
+{
+    // OL_SaveImage writes 32 bit RGBA
+    ASSERTF(img.format == GL_RGBA && img.type == GL_UNSIGNED_BYTE,
+            "format %#x type %#x", img.format, img.type);
+    submitSave(fname, [img, fname, flip]() {
+            OutlawImage im = img;
+            if (flip && im.data)
+            {
+                const size_t stride = (size_t)im.width * 4;
+                for (int y=0; y<im.height/2; y++) {
+                    char *row = &im.data[y * stride];
+                    std::swap_ranges(row, row + stride, &im.data[(im.height - y - 1) * stride]);
+                }
+            }
+            const bool success = OL_SaveImage(&im, fname.c_str());
+            free(im.data);
+            return success;
+        }, std::move(cb));
+}
+
+int AIO_Poll()
+{
+    return AsyncIO::instance().poll();
+}
+
+void AIO_Flush()
+{
+    AsyncIO::instance().flush();
+}
+
+int AIO_Pending()
+{
+    AsyncIO &aio = AsyncIO::instance();
+    std::lock_guard<std::mutex> l(aio.mutex);
+    return aio.pending + aio.waiting;
+}
+
+void AIO_Shutdown()
+{
+    AIO_Flush();
+    AsyncIO::instance().stop();
+}
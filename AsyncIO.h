@@ -0,0 +1,46 @@
+
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+// Asynchronous file IO
+//
+// Requests run on background threads so saves, screenshots and loads can
+// overlap with simulation. Raw reads and writes go through io_uring on linux
+// when built with OL_HAS_IO_URING (see os/linux/PlatformIncludes.h),
+// everything else runs on a small thread pool. Completion callbacks run on whichever thread calls AIO_Poll, normally
+// once per frame from the update thread. Saves to the same file name run one
+// at a time in submission order.
+
+#ifndef OL_HAS_IO_URING
+#define OL_HAS_IO_URING 0
+#endif
+
+typedef std::function<void(bool success)>                AIOSaveCallback;
+typedef std::function<void(bool success, string &&data)> AIOLoadCallback;
+
+// same as SaveFile, SaveCompressedFile and LoadFile in Save.h
+void AIO_SaveFile(const string &fname, string data, AIOSaveCallback cb=NULL);
+void AIO_SaveCompressedFile(const string &fname, string data, AIOSaveCallback cb=NULL);
+void AIO_LoadFile(const string &fname, AIOLoadCallback cb);
+
+// same as ZF_SaveFileRaw and ZF_LoadFileRaw in ZipFile.h
+void AIO_SaveFileRaw(const string &fname, string data, AIOSaveCallback cb=NULL);
+void AIO_LoadFileRaw(const string &fname, AIOLoadCallback cb);
+
+// same as OL_SaveImage. Takes ownership of img.data, which must be malloced.
+// flip vertically first if FLIP (e.g. for glGetTexImage output)
+void AIO_SaveImage(const OutlawImage &img, const string &fname, bool flip, AIOSaveCallback cb=NULL);
+
+// run completed callbacks on the calling thread, return number run
+int AIO_Poll();
+
+// block until all outstanding requests complete, then run their callbacks
+void AIO_Flush();
+
+// number of requests not yet completed
+int AIO_Pending();
+
+// flush and stop background threads
+void AIO_Shutdown();
+
+#endif
@@ -84,7 +84,7 @@ struct FrameLogger {
     Dict                                         m_current;
 
     // shared, mutex protected
-    std::mutex                                   m_mutex;
+    profiled_mutex                               m_mutex { "FrameLogger" };
     std::deque< Dict >                           m_log;
     std::unordered_map<lstring, PhaseData>       m_phaseData;
 
@@ -162,7 +162,7 @@ struct FrameLogger {
             return;
         map_setdefault(m_current, phase, 0.0) += length;
 
-        std::lock_guard<std::mutex> l(m_mutex);
+        std::lock_guard<profiled_mutex> l(m_mutex);
         m_phaseData[phase].stacked = false;
     }
 
@@ -189,7 +189,7 @@ struct FrameLogger {
             addPhase("Frame", frame_time);
         }
 
-        std::lock_guard<std::mutex> l(m_mutex);
+        std::lock_guard<profiled_mutex> l(m_mutex);
         for_ (phase, m_current) {
         // foreach (const PhaseTime& phase, m_current) {
             PhaseData &pd = m_phaseData[phase.first];
@@ -208,7 +208,7 @@ struct FrameLogger {
 
     void renderGraph(const ShaderState& ss, DMesh &mesh, float2 graphStart, float2 graphSize)
     {
-        std::lock_guard<std::mutex> l(m_mutex);
+        std::lock_guard<profiled_mutex> l(m_mutex);
 
         if (m_log.empty())
             return;
@@ -624,6 +624,19 @@ void TextInputBase::render(const ShaderState &s_)
     }
 }
 
+#if OL_LOCK_PROFILE
+static string cmd_lock_report(void* data, const char* name, const char* args)
+{
+    const string arg = str_strip(args);
+    if (arg == "reset") {
+        lock_profile_reset();
+        return "lock statistics reset";
+    }
+    const int count = arg.size() ? atoi(arg.c_str()) : 10;
+    return lock_profile_report(max(1, count));
+}
+#endif
+
 TextInputCommandLine::TextInputCommandLine()
 {
     // 120 on mac, 100 on windows??
@@ -634,6 +647,9 @@ TextInputCommandLine::TextInputCommandLine()
 
     registerCommand(cmd_help, comp_help, this, "help", "[command]: list help for specified command, or all commands if unspecified");
     registerCommand(cmd_find, comp_help, this, "find", "[string]: list commands matching search");
+#if OL_LOCK_PROFILE
+    registerCommand(cmd_lock_report, NULL, this, "lock_report", "[count|reset]: list the most contended locks");
+#endif
     setLineText("");
 }
 
@@ -30,6 +30,7 @@
 #include "Graphics.h"
 #include "Shaders.h"
 #include "Event.h"
+#include "AsyncIO.h"
 
 #ifndef ASSERT_MAIN_THREAD
 #define ASSERT_MAIN_THREAD()
@@ -678,6 +679,34 @@ bool GLTexture::writeFile(const char *fname) const
 #endif
 }
 
+bool GLTexture::writeFileAsync(const char *fname) const
+{
+#if OPENGL_ES
+    return false;
+#else
+    const int2 sz = ceil_int(m_texsize);
+    const size_t size = sz.x * sz.y * 4;
+    if (size == 0 || m_texname == 0)
+        return false;
+    
+    uint *pix = (uint*) malloc(size);
+
+    OutlawImage img = {};
+    img.width = sz.x;
+    img.height = sz.y;
+    img.format = GL_RGBA;
+    img.type = GL_UNSIGNED_BYTE;
+    img.data = (char*) pix;
+
+    BindTexture(0);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pix);
+    glReportError();
+
+    AIO_SaveImage(img, fname, true);
+    return true;
+#endif
+}
+
 
 GLTexture PixImage::uploadTexture() const
 {
@@ -287,6 +287,8 @@ public:
     bool loadImage(OutlawImage *img);
     bool loadFile(const char* fname);
     bool writeFile(const char *fname) const;
+    // read back pixels now, encode and write png on the AsyncIO threads
+    bool writeFileAsync(const char *fname) const;
 
     void BindTexture(int slot) const
     {
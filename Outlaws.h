@@ -265,6 +265,7 @@ int OL_CreateParentDirs(const char* fname);
 int OL_CopyFile(const char* source, const char *dest);
 
 // Return list of files in a directory (base name only - no path)
+// valid until the next call on the same thread
 const char** OL_ListDirectory(const char* path);
 
 // get complete path for data file in utf8, searching through save directory and application resource directory
@@ -290,7 +291,12 @@ const char* OL_SandboxOpenFile(void); /* always .lua or .lua.gz! */
 #ifdef __cplusplus
 }
 
+// thread safe OL_ListDirectory returning an owned, sorted list. Listings are
+// cached per directory and invalidated when the directory changes (linux)
+std::vector<std::string> OL_ListDirectoryFiles(const char* path);
+
 // convenience for c++ strings
+inline std::vector<std::string> OL_ListDirectoryFiles(const std::string &path) { return OL_ListDirectoryFiles(path.c_str()); }
 inline const char** OL_ListDirectory(const std::string &path) { return OL_ListDirectory(path.c_str()); }
 inline int OL_RemoveFileOrDirectory(const std::string &dirname) { return OL_RemoveFileOrDirectory(dirname.c_str()); }
 inline const char *OL_PathForFile(const std::string &fname, const char *mode) { return OL_PathForFile(fname.c_str(), mode); }
@@ -32,7 +32,7 @@ void ParticleSystem::setTime(Particle &p, float t)
 
 void ParticleSystem::setParticles(vector<Particle>& particles)
 {
-    std::lock_guard<std::mutex> l(m_mutex);
+    std::lock_guard<profiled_mutex> l(m_mutex);
     
     m_vertices.resize(m_particle_verts * particles.size());
 
@@ -55,13 +55,13 @@ void ParticleSystem::setParticles(vector<Particle>& particles)
 
 void ParticleSystem::addTrail(const ParticleTrail& p)
 {
-    // std::lock_guard<std::mutex> l(m_add_mutex);
+    // std::lock_guard<profiled_mutex> l(m_add_mutex);
     m_trails.push_back(p); 
 }
 
 void ParticleSystem::add(const Particle &p)
 {
-    std::lock_guard<std::mutex> l(m_add_mutex);
+    std::lock_guard<profiled_mutex> l(m_add_mutex);
     if (m_queued_particles.size() >= kMinQueuedParticles -1)
     {
         for_ (pt, m_queued_particles)
@@ -122,7 +122,7 @@ bool ParticleSystem::alloc(const Particle &p)
     // else grow
     m_addPos = vsize;
     {
-        std::lock_guard<std::mutex> l(m_mutex);
+        std::lock_guard<profiled_mutex> l(m_mutex);
         const int size = clamp((int)vsize * 2, kMinParticles * m_particle_verts, m_maxParticles * m_particle_verts);
         DPRINT(SHADER, ("Changing particle count from %.2e to %.2e", (double) vsize, (double) size));
         m_vertices.resize(size);
@@ -211,12 +211,12 @@ void ShaderParticlesInstance()
 void ParticleSystem::shrink_to_fit()
 {
     {
-        std::lock_guard<std::mutex> l(m_mutex);
+        std::lock_guard<profiled_mutex> l(m_mutex);
         clear();
         m_vertices.shrink_to_fit();
     }
 
-    std::lock_guard<std::mutex> l(m_add_mutex);
+    std::lock_guard<profiled_mutex> l(m_add_mutex);
     m_queued_particles.shrink_to_fit();
 }
 
@@ -236,14 +236,14 @@ void ParticleSystem::update(uint step, float time)
 	const int verts = kParticleTris ? kParticleVerts : 1;
     if (count() > m_maxParticles || verts != m_particle_verts)
     {
-        std::lock_guard<std::mutex> l(m_mutex);
+        std::lock_guard<profiled_mutex> l(m_mutex);
         m_vertices.resize(m_maxParticles * m_particle_verts);
         m_particle_verts = verts;
         m_addPos = 0;
         m_addFirst = -1;
     }
 
-    std::lock_guard<std::mutex> l(m_add_mutex);
+    std::lock_guard<profiled_mutex> l(m_add_mutex);
     for (uint i=0; i<m_trails.size(); )
     {
         ParticleTrail& tr = m_trails[i];
@@ -294,7 +294,7 @@ void ParticleSystem::render(const ShaderState &ss, const View& view, float time)
     }
 
     {
-        std::lock_guard<std::mutex> l(m_add_mutex);
+        std::lock_guard<profiled_mutex> l(m_add_mutex);
         for_ (pt, m_queued_particles)
             alloc(pt);
         m_queued_particles.clear();
@@ -304,7 +304,7 @@ void ParticleSystem::render(const ShaderState &ss, const View& view, float time)
     const int addPos = m_addPos;
     if (m_addFirst != addPos)
     {
-        std::lock_guard<std::mutex> l(m_mutex);
+        std::lock_guard<profiled_mutex> l(m_mutex);
 
         if (m_vertices.size() == m_vbo.size() && m_addFirst >= 0)
         {
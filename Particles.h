@@ -68,8 +68,8 @@ private:
     uint                    m_lastMaxedStep = -1;
     int                     m_particle_verts = 1;
     float                   m_planeZ = 0.f;
-    std::mutex              m_mutex;
-    std::mutex              m_add_mutex;
+    profiled_mutex          m_mutex { "ParticleSystem" };
+    profiled_mutex          m_add_mutex { "ParticleSystem add" };
     View                    m_view;
     vector<ParticleTrail>   m_trails;
     const IParticleShader  *m_program = NULL;
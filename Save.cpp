@@ -60,31 +60,32 @@ bool SaveParser::loadData(const char* dta, const string &fn)
 {
     fname        = fn;
     data         = dta;
-    dataLastLine = data;
-    dataline     = 0;
     start        = data;
     dend         = NULL;
     error_count  = 0;
+    lineIndex.clear();
     
     return data != NULL;
 }
 
-static const char* kExtensions[] = {".lua", ".lua.gz", ".lisp", ".lisp.gz", ".txt", ".json", ".json.gz"};
+static const char* kExtensions[] = {".lua", ".lua.gz", ".lua.lz4", ".lua.zst", ".lisp", ".lisp.gz",
+                                     ".txt", ".json", ".json.gz", ".json.lz4", ".json.zst"};
 
 bool SaveParser::loadFile(const string& fname_)
 {
     if (!vec_any(kExtensions, [&](const char* ex) { return str_endswith(fname_, ex); }))
         return false;
-    buffer = LoadFile(fname_);
+    buffer = LoadFileShared(fname_);
     fname = fname_;
     resetFile();
-    return buffer.size();
+    return buffer && buffer->size();
 }
 
 void SaveParser::resetFile()
 {
-    loadData(buffer.c_str(), fname);
-    dend = data + buffer.size();
+    const string &buf = getBuffer();
+    loadData(buf.c_str(), fname);
+    dend = data + buf.size();
 }
 
 SaveSerializer& SaveSerializer::instance()
@@ -380,16 +381,11 @@ void SaveSerializer::serializeE(uint64 v, const EnumType &e)
     if ((flags&JSON) && e.isBitset())
     {
         insertToken('[');
-        foreach (const EnumType::Elem &se, e.elems)
-        {
-            if ((v&se.second) != se.second)
-                continue;
-            insertName(se.first.c_str());
-            v &= ~se.second;
-            if (v == 0)
-                break;
-            insertToken(',');
-        }
+        e.decompose(v, [&](lstring name, uint64 rest) {
+                insertName(name.c_str());
+                if (rest)
+                    insertToken(',');
+            });
         insertToken(']');
         return;
     }
@@ -397,16 +393,14 @@ void SaveSerializer::serializeE(uint64 v, const EnumType &e)
     // then try to build up bits
     if (v != 0 && v != ~0 && e.isBitset())
     {
-        foreach (const EnumType::Elem &se, e.elems)
-        {
-            if ((v&se.second) != se.second)
-                continue;
-            o += se.first.c_str();
-            v &= ~se.second;
-            if (v == 0)
-                return;
-            o += (flags&LISP) ? '/' : '|';
-        }
+        const char sep = (flags&LISP) ? '/' : '|';
+        v = e.decompose(v, [&](lstring name, uint64 rest) {
+                o += name.c_str();
+                if (rest)
+                    o += sep;
+            });
+        if (v == 0)
+            return;
     }
     // finally resort to numbers!!!
     serialize(v);
@@ -435,19 +429,47 @@ static bool scanEof(const char* data)
     return (*data == '\0');
 }
 
+int LineIndex::find(const char* start, const char* end, const char* ptr, const char** lineBegin)
+{
+    if (!start || ptr < start)
+    {
+        if (lineBegin)
+            *lineBegin = ptr;
+        return 0;
+    }
+    
+    // build the index once per buffer, so reporting thousands of warnings is not quadratic
+    if (lines.empty())
+    {
+        if (!end)
+            end = start + strlen(start);
+        lines.push_back(0);
+        for (const char* nl=start; (nl = (const char*)memchr(nl, '\n', end - nl)); nl++)
+            lines.push_back(nl - start + 1);
+    }
+
+    const uint offset = ptr - start;
+    const int line = (std::upper_bound(lines.begin(), lines.end(), offset) - lines.begin()) - 1;
+    if (lineBegin)
+        *lineBegin = start + lines[line];
+    return line;
+}
+
+int SaveParser::getLine(const char* ptr, const char** lineBegin) const
+{
+    return lineIndex.find(start, dend, ptr, lineBegin);
+}
+
 ParserLocation SaveParser::getCurrentLoc() const
 {
     ParserLocation loc;
     loc.fname = fname;
-    loc.line = dataline;
     loc.logger = logger;
 
-    const char* lineBegin = std::max(data, start + 1);
-    while (lineBegin > dataLastLine && *(lineBegin-1) != '\n' && *(lineBegin-1) != '\0' &&
-           (data - lineBegin) < 200)
-    {
-        lineBegin--;
-    }
+    const char* lineBegin = data;
+    loc.line = getLine(data, &lineBegin);
+    if (data - lineBegin > 200)
+        lineBegin = data - 200;
     for (const char *ptr=lineBegin; *ptr != '\0' && *ptr != '\n' && (ptr - lineBegin) < 300; ptr++)
         loc.currentLine += *ptr;
     loc.currentLine = str_chomp(loc.currentLine);
@@ -554,8 +576,6 @@ char SaveParser::nextChar()
 {
     const char chr = *data;
     if (chr == '\n') {
-        dataLastLine = data + 1;
-        dataline++;
         if (progress)
         {
             if (!dend)
@@ -760,6 +780,26 @@ bool SaveParser::parseIdent(std::string* s, const char** after)
     return true;
 }
 
+bool SaveParser::parseIdentRange(const char** ident, size_t *len)
+{
+    skipSpace();
+    const char *ptr = data;
+    const bool quoted = (*ptr == '"'); // json
+    if (quoted)
+        ptr++;
+    if (!str_issym(*ptr))
+        return false;
+    const char *begin = ptr;
+    while (is_ident(*ptr))
+        ptr++;
+    if (quoted && *ptr++ != '"')
+        return false;           // escapes, etc. use parseQuotedString
+    *ident = begin;
+    *len = (ptr - begin) - (quoted ? 1 : 0);
+    data = ptr;
+    return true;
+}
+
 static bool isargs(char c)
 {
     return c && (str_issym(c) || str_isdigit(c) || c == '-' || c == '.');
@@ -1021,13 +1061,22 @@ bool SaveParser::parseE(uint64 *h, const EnumType &e)
     ParseContext pc(this, e.name.c_str());
     std::string s;
     
+    const char* ident = NULL;
+    size_t      len   = 0;
+    
     if (parseToken('['))        // JSON
     {
         while (!parseToken(']'))
         {
-            PARSE_FAIL_UNLESS(parse(&s), "expected enum field");
-            const uint64 val = e.getVal(str_toupper(s));
-            PARSE_FAIL_UNLESS(val != ~0, "enum '%s' has no member '%s'", e.name, s);
+            uint64 val = ~0;
+            if (parseIdentRange(&ident, &len)) {
+                val = e.getValUpper(ident, len);
+                PARSE_FAIL_UNLESS(val != ~0, "enum '%s' has no member '%s'", e.name, string(ident, len));
+            } else {
+                PARSE_FAIL_UNLESS(parse(&s), "expected enum field");
+                val = e.getValUpper(s);
+                PARSE_FAIL_UNLESS(val != ~0, "enum '%s' has no member '%s'", e.name, s);
+            }
             *h |= val;
             parseToken(',');
         }
@@ -1036,9 +1085,15 @@ bool SaveParser::parseE(uint64 *h, const EnumType &e)
     }
     
     do {
-        if (parseIdent(&s))
+        if (parseIdentRange(&ident, &len))
+        {
+            const uint64 val = e.getValUpper(ident, len);
+            PARSE_FAIL_UNLESS(val != ~0, "enum '%s' has no member '%s'", e.name, string(ident, len));
+            *h |= val;
+        }
+        else if (parseIdent(&s))
         {
-            const uint64 val = e.getVal(str_toupper(s));
+            const uint64 val = e.getValUpper(s);
             PARSE_FAIL_UNLESS(val != ~0, "enum '%s' has no member '%s'", e.name, s);
             *h |= val;
         }
@@ -1068,6 +1123,185 @@ int DynamicObj::skip(SaveParser &p) const { return type->skip(p); }
 const string &DynamicObj::name() const { return type->name(); }
 void DynamicObj::clear() const { type->clear(self); }
 
+// patch format:
+// uint type name hash, then for each changed leaf field:
+// uchar depth, ushort index[depth], uint length, byte value[length] (SaveSerializer BINARY)
+
+typedef vector<ushort> DiffPath;
+
+static void diffReplace(string &patch, const DiffPath &path, const DynamicObj &b)
+{
+    SaveSerializer ss(SaveSerializer::BINARY|SaveSerializer::COMPACT);
+    b.serialize(ss);
+    str_append_bytes(patch, (uchar)path.size());
+    for_ (idx, path)
+        str_append_bytes(patch, idx);
+    str_append_bytes(patch, (uint)ss.str().size());
+    patch += ss.str();
+}
+
+static void diffDynamicObj1(string &patch, DiffPath &path, const DynamicObj &a, const DynamicObj &b)
+{
+    const size_t size = a.size();
+    if (size == 0 || path.size() >= 0xff)
+    {
+        if (!(a == b))
+            diffReplace(patch, path, b);
+        return;
+    }
+
+    // containers that changed length and objects with more fields than a ushort index can
+    // address are replaced whole
+    if (size != b.size() || size > 0x10000)
+    {
+        diffReplace(patch, path, b);
+        return;
+    }
+
+    const size_t start = patch.size();
+    for (uint i=0; i<size; i++)
+    {
+        const DynamicObj ca = a[i];
+        const DynamicObj cb = b[i];
+        if (!ca.self && !cb.self)
+            continue;
+        if (!ca.self || !cb.self || ca.type != cb.type)
+        {
+            // field changed nullness or dynamic type, so it can't be patched in
+            // place. Replace the enclosing object instead
+            patch.resize(start);
+            diffReplace(patch, path, b);
+            return;
+        }
+        path.push_back(i);
+        diffDynamicObj1(patch, path, ca, cb);
+        path.pop_back();
+    }
+}
+
+string diffDynamicObj(const DynamicObj &a, const DynamicObj &b)
+{
+    string patch;
+    ASSERT(a.type == b.type);
+    if (a.type != b.type || !a.self || !b.self)
+        return patch;
+    str_append_bytes(patch, (uint)str_hash(a.name().c_str()));
+    DiffPath path;
+    diffDynamicObj1(patch, path, a, b);
+    return patch;
+}
+
+static bool patchFail(const DynamicObj &obj, const char* msg)
+{
+    Reportf("patchDynamicObj: %s for type '%s'", msg, obj.name().c_str());
+    return false;
+}
+
+#define PATCH_READ(V)                                   \
+    if (idx + sizeof(*(V)) > patch.size())              \
+        return patchFail(obj, "truncated patch");       \
+    idx += str_read_bytes(patch.data(), idx, (V))
+
+bool patchDynamicObj(const DynamicObj &obj, const string &patch)
+{
+    if (!obj.self)
+        return false;
+    size_t idx = 0;
+    uint hash = 0;
+    PATCH_READ(&hash);
+    if (hash != (uint)str_hash(obj.name().c_str()))
+        return patchFail(obj, "type mismatch");
+
+    string value;
+    while (idx < patch.size())
+    {
+        uchar depth = 0;
+        PATCH_READ(&depth);
+        DynamicObj dy = obj;
+        for (int i=0; i<depth; i++)
+        {
+            ushort field = 0;
+            PATCH_READ(&field);
+            // stale or corrupt patches may not match this layout
+            if (!dy.self || !dy.type || field >= dy.size())
+                return patchFail(obj, "corrupt patch");
+            dy = dy[field];
+        }
+        uint length = 0;
+        PATCH_READ(&length);
+        if (!dy.self || idx + length > patch.size())
+            return patchFail(obj, "corrupt patch");
+        value.assign(&patch[idx], length);
+        idx += length;
+
+        SaveParser sp(value);
+        dy.clear();
+        if (!dy.parse(sp))
+            return patchFail(obj, "parse error");
+    }
+    return true;
+}
+
+#undef PATCH_READ
+
+#if IS_DEVEL
+
+#define SERIAL_DIFF_TEST_CHILD_FIELDS(F)                        \
+    F(int,                  value,          0)                  \
+    F(string,               label,          string())           \
+
+DECLARE_DEFINE_SERIAL_STRUCT(DiffTestChild, SERIAL_DIFF_TEST_CHILD_FIELDS);
+
+#define SERIAL_DIFF_TEST_FIELDS(F)                                      \
+    F(int,                          ident,      0)                      \
+    F(string,                       name,       string())               \
+    F(std::vector<int>,             values,     std::vector<int>())     \
+    F(std::vector<DiffTestChild>,   children,   std::vector<DiffTestChild>()) \
+    F(copy_ptr<DiffTestChild>,      child,      copy_ptr<DiffTestChild>()) \
+
+DECLARE_DEFINE_SERIAL_STRUCT(DiffTest, SERIAL_DIFF_TEST_FIELDS);
+
+static bool diffRoundTrip(const DiffTest &a, const DiffTest &b)
+{
+    DiffTest c = a;
+    return patchObject(&c, diffObjects(a, b)) && c == b;
+}
+
+#endif
+
+bool save_runtests()
+{
+#if IS_DEVEL
+    Report("Beginning Save Tests");
+    DiffTest a;
+    a.ident = 1;
+    a.name = "alpha";
+    a.values = { 1, 2, 3 };
+    a.children.resize(2);
+    a.children[0].label = "first";
+
+    DiffTest b = a;
+    b.name = "beta";
+    b.values.push_back(4);                  // container length change
+    b.children[1].value = 7;                // nested leaf
+    b.child = DiffTestChild();              // null to non-null
+    b.child->label = "child";
+
+    ASSERT(diffObjects(a, a).size() == sizeof(uint));
+    ASSERT(diffRoundTrip(a, b));
+    ASSERT(diffRoundTrip(b, a));            // undo, including non-null to null
+
+    string bad = diffObjects(a, b);
+    ASSERT(bad[sizeof(uint)] == 1);         // first entry is a top level field
+    bad[sizeof(uint) + 1] = bad[sizeof(uint) + 2] = (char) 0xff;
+    DiffTest c = a;
+    ASSERT(!patchObject(&c, bad));          // field index out of range
+
+    Report("Ending Save Tests");
+#endif
+    return true;
+}
+
 template <typename T>        
 static bool skipDeprecated(SaveParser &sp, const char* name)
 {
@@ -1469,43 +1703,73 @@ bool SaveFile(const char* fname, const char* data, int size)
     return ZF_SaveFileRaw(fname, data, size);
 }
 
-bool SaveCompressedFile(const char* fname, const char* data, int size)
+bool SaveCompressedFile(const char* fname, const char* data, int size, ZFCodec codec)
 {
+    if (!ZF_CodecAvailable(codec))
+        codec = ZF_GZIP;
+
     if (isSteamCloudEnabled() && !str_startswith(fname, "~"))
     {
+        // steam cloud LoadFile only looks for .gz
         const string bytes = ZF_Compress(data, size);
         const string gzname = str_format("%s.gz", fname);
         if (steamFileWrite(gzname.c_str(), &bytes[0], bytes.size(), size))
             return true;
     }
 
-    return ZF_SaveFile(fname, data, size);
+    return ZF_SaveFile(fname, data, size, codec);
 }
 
 
-string LoadFile(const char* fname)
+// true if FNAME was found in steam cloud
+static bool loadSteamFile(const char* fname, string *data)
 {
-    if (isSteamCloudEnabled())
+    if (!isSteamCloudEnabled())
+        return false;
+
+    const string gzname = str_format("%s.gz", fname);
+    if (SteamFileExists(gzname.c_str()))
     {
-        const string gzname = str_format("%s.gz", fname);
-        if (SteamFileExists(gzname.c_str()))
-        {
-            // 1. steam gzipped file
-            string data = steamFileRead(SteamRemoteStorage(), gzname.c_str());
-            if (data.size())
-                return ZF_Decompress(data.data(), data.size());
-        }
-        else if (SteamFileExists(fname))
-        {
-            // 2. steam uncompressed file
-            return steamFileRead(SteamRemoteStorage(), fname);
-        }
+        // 1. steam gzipped file
+        string gzdata = steamFileRead(SteamRemoteStorage(), gzname.c_str());
+        if (gzdata.empty())
+            return false;
+        *data = ZF_Decompress(gzdata.data(), gzdata.size());
+        return true;
     }
+    else if (SteamFileExists(fname))
+    {
+        // 2. steam uncompressed file
+        *data = steamFileRead(SteamRemoteStorage(), fname);
+        return true;
+    }
+    return false;
+}
+
+string LoadFile(const char* fname)
+{
+    string data;
+    if (loadSteamFile(fname, &data))
+        return data;
 
     // 3. system files
     return ZF_LoadFile(fname);
 }
 
+std::shared_ptr<const string> LoadFileShared(const char* fname)
+{
+    string data;
+    if (loadSteamFile(fname, &data))
+    {
+        if (data.empty())
+            return NULL;
+        return std::make_shared<const string>(std::move(data));
+    }
+
+    // 3. system files, through the load cache
+    return ZF_LoadFileShared(fname);
+}
+
 string LoadFileRaw(const char* fname)
 {
     if (isSteamCloudEnabled() && SteamFileExists(fname))
@@ -1555,10 +1819,7 @@ bool FileExists(const char* fname)
 
 vector<string> ListDirectory(const char* dname)
 {
-    vector<string> files;
-    
-    for (const char **ptr=OL_ListDirectory(dname); ptr && *ptr; ++ptr)
-        files.push_back(*ptr);
+    vector<string> files = OL_ListDirectoryFiles(dname);
 
     const string base = str_path_standardize(dname) + "/";
     SteamForEachFile([&](const string &name, int size) {
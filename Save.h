@@ -21,16 +21,20 @@ inline bool SaveFile(const string &fname, const string &data) {
     return SaveFile(fname.c_str(), &data[0], data.size());
 }
 
-// write a compressed save file to FNAME.gz, possibly to steam cloud
-bool SaveCompressedFile(const char* fname, const char* data, int size);
-inline bool SaveCompressedFile(const string &fname, const string &data) {
-    return SaveCompressedFile(fname.c_str(), &data[0], data.size());
+// write a compressed save file to FNAME.gz (or .lz4/.zst), possibly to steam cloud
+bool SaveCompressedFile(const char* fname, const char* data, int size, ZFCodec codec=ZF_GZIP);
+inline bool SaveCompressedFile(const string &fname, const string &data, ZFCodec codec=ZF_GZIP) {
+    return SaveCompressedFile(fname.c_str(), &data[0], data.size(), codec);
 }
 
 // load a saved file, possibly from steam cloud
 string LoadFile(const char* fname);
 inline string LoadFile(const string &str) { return LoadFile(str.c_str()); }
 
+// like LoadFile, but shares the buffer with the ZF_LoadFile cache. NULL if missing
+std::shared_ptr<const string> LoadFileShared(const char* fname);
+inline std::shared_ptr<const string> LoadFileShared(const string &str) { return LoadFileShared(str.c_str()); }
+
 // load file without decompression
 string LoadFileRaw(const char* fname);
 inline string LoadFileRaw(const string &str) { return LoadFileRaw(str.c_str()); }
@@ -577,6 +581,17 @@ public:
     }
 };
 
+// offset of each line start in a parse buffer, built on first use
+struct LineIndex {
+    vector<uint> lines;
+
+    void clear() { lines.clear(); }
+
+    // 0 based line containing PTR in [START, END), END may be NULL for a NUL terminated buffer
+    // set *LINEBEGIN to the first character of that line
+    int find(const char* start, const char* end, const char* ptr, const char** lineBegin=NULL);
+};
+
 struct ParserLocation {
 
     string fname;
@@ -601,12 +616,10 @@ struct SaveParser {
 
 private:
     string       fname;
-    string       buffer;
+    std::shared_ptr<const string> buffer; // shared with the load cache
     const char*  start        = NULL;
     const char*  dend         = NULL;
     const char*  data         = NULL;
-    uint         dataline     = 0;
-    const char*  dataLastLine = NULL;
     float*       progress     = NULL;
     mutable int  error_count  = 0;
     mutable int  warn_count   = 0;
@@ -929,6 +942,9 @@ private:
 
     char nextChar();
 
+    mutable LineIndex lineIndex;
+    int getLine(const char* ptr, const char** lineBegin=NULL) const;
+
 public:
 
     SaveParser() ;
@@ -954,8 +970,12 @@ public:
     bool getCliMode() const { return cliMode; }
 
     const char* c_str() const { return data; }
-    int size() const { return buffer.size() ? buffer.size() : data ? strlen(data) : 0; }
-    const std::string &getBuffer() const { return buffer; }
+    int size() const { return (buffer && buffer->size()) ? buffer->size() : data ? strlen(data) : 0; }
+    const std::string &getBuffer() const
+    {
+        static const string empty;
+        return buffer ? *buffer : empty;
+    }
 
     // return true if data completely parses into v.
     // may write v but return false if there is trailing garbage
@@ -1042,6 +1062,8 @@ public:
     bool atToken(char token);
     bool atToken(const char* token);
     bool parseIdent(string* s, const char** after=NULL);
+    // parse identifier without copying - points into buffer
+    bool parseIdentRange(const char** ident, size_t *len);
     bool parseArg(string* s);
     bool parseName(string* s);
     bool parseName(lstring* s)
@@ -1432,6 +1454,27 @@ bool serializeToFile(const string &fname, const T& val)
     return ZF_SaveFileRaw(fname.c_str(), ss.str());
 }
 
+// structural diff of two reflected objects of the same type, walking fields through
+// ReflectionLayout. Returns a compact binary patch containing only the fields that differ
+// - patchDynamicObj(a, diffDynamicObj(a, b)) makes a equal to b. Empty if types differ
+string diffDynamicObj(const DynamicObj &a, const DynamicObj &b);
+bool patchDynamicObj(const DynamicObj &obj, const string &patch);
+
+template <typename T>
+string diffObjects(const T& a, const T& b)
+{
+    return diffDynamicObj(DynamicObj(const_cast<T*>(&a)), DynamicObj(const_cast<T*>(&b)));
+}
+
+template <typename T>
+bool patchObject(T* obj, const string &patch)
+{
+    return patchDynamicObj(DynamicObj(obj), patch);
+}
+
+// self tests for diff/patch round trips (IS_DEVEL only)
+bool save_runtests();
+
 template <typename T> void SaveSerializer_serialize(SaveSerializer &s, const void *dat)
 {
     s.serialize((const T*)dat);
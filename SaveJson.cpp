@@ -0,0 +1,467 @@
+
+#include "StdAfx.h"
+#include "SaveJson.h"
+
+void JsonSerializer::appendUInt(uint64 v)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *ptr = end;
+    do {
+        *--ptr = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    o.append(ptr, end - ptr);
+}
+
+void JsonSerializer::appendInt(long long v)
+{
+    if (v < 0) {
+        o += '-';
+        appendUInt(uint64(0) - uint64(v));
+    } else {
+        appendUInt(v);
+    }
+}
+
+// no NaN or Inf in JSON
+void JsonSerializer::appendNonFinite(double f)
+{
+    Reportf("JsonSerializer: writing non-finite value %g as 0", f);
+    o += '0';
+}
+
+void JsonSerializer::serialize(float f)
+{
+    if (!std::isfinite(f)) {
+        appendNonFinite(f);
+        return;
+    }
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "%.9g", f);
+    o.append(buf, len);
+}
+
+void JsonSerializer::serialize(double f)
+{
+    if (!std::isfinite(f)) {
+        appendNonFinite(f);
+        return;
+    }
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "%.17g", f);
+    o.append(buf, len);
+}
+
+void JsonSerializer::serialize(const char* s)
+{
+    o += '"';
+    if (!s) {
+        o += '"';
+        return;
+    }
+
+    static const char kHex[] = "0123456789abcdef";
+    const char *run = s;
+    for (; *s; ++s)
+    {
+        const uchar c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        o.append(run, s - run);
+        run = s + 1;
+        switch (c) {
+        case '"':  o += "\\\""; break;
+        case '\\': o += "\\\\"; break;
+        case '\n': o += "\\n"; break;
+        case '\r': o += "\\r"; break;
+        case '\t': o += "\\t"; break;
+        default:
+            o += "\\u00";
+            o += kHex[c>>4];
+            o += kHex[c&0xf];
+            break;
+        }
+    }
+    o.append(run, s - run);
+    o += '"';
+}
+
+void JsonSerializer::serialize(const Symbol &s)
+{
+    serialize(s.str().c_str());
+}
+
+void JsonSerializer::serialize(LispVal cons, const LispEnv *heap)
+{
+    SaveSerializer ss;
+    ss.serialize(cons, heap);
+    serialize(ss.str());
+}
+
+void JsonSerializer::serializeE(uint64 v, const EnumType &e)
+{
+    lstring name = e.getName(v);
+    if (name)
+    {
+        serialize(name.c_str());
+    }
+    else if (v != 0 && e.isBitset())
+    {
+        o += '[';
+        v = e.decompose(v, [&](lstring nm, uint64 rest) {
+                serialize(nm.c_str());
+                o += ',';
+            });
+        if (v)
+            appendUInt(v);
+        close(']');
+    }
+    else
+    {
+        appendUInt(v);
+    }
+}
+
+string JsonParser::errmsg(const string &msg) const
+{
+    const char* lineBegin = data;
+    const int line = lineIndex.find(start, NULL, data, &lineBegin) + 1;
+    return str_format("%s:%d:%d: error: %s", fname.c_str(), line, (int)(data - lineBegin) + 1, msg.c_str());
+}
+
+bool JsonParser::parseNull()
+{
+    skipSpace();
+    if (strncmp(data, "null", 4) != 0)
+        return false;
+    data += 4;
+    return true;
+}
+
+bool JsonParser::parseStringRange(const char** str, size_t *len)
+{
+    skipSpace();
+    if (*data != '"')
+        return false;
+    const char* ptr = data + 1;
+    while (*ptr != '"' && *ptr != '\\' && *ptr != '\0')
+        ptr++;
+    if (*ptr != '"')
+        return false;
+    *str = data + 1;
+    *len = ptr - *str;
+    data = ptr + 1;
+    return true;
+}
+
+// opening quote already parsed
+bool JsonParser::parseStringContents(string *s)
+{
+    s->clear();
+    for (;;)
+    {
+        const char* run = data;
+        while (*data != '"' && *data != '\\' && *data != '\0')
+            data++;
+        s->append(run, data - run);
+
+        if (*data == '"') {
+            data++;
+            return true;
+        } else if (*data == '\0') {
+            return fail("expected closing '\"' while parsing string, got EOF");
+        }
+
+        data++;                 // backslash
+        switch (*data) {
+        case '"':  *s += '"';  break;
+        case '\\': *s += '\\'; break;
+        case '/':  *s += '/';  break;
+        case 'b':  *s += '\b'; break;
+        case 'f':  *s += '\f'; break;
+        case 'n':  *s += '\n'; break;
+        case 'r':  *s += '\r'; break;
+        case 't':  *s += '\t'; break;
+        case 'u': {
+            char* end = NULL;
+            char hex[5] = {};
+            strncpy(hex, data + 1, 4);
+            int chr = strtol(hex, &end, 16);
+            if (end != hex + 4)
+                return fail("invalid \\u escape in string");
+            data += 4;
+            // utf16 surrogate pair
+            if (0xd800 <= chr && chr < 0xdc00 && data[1] == '\\' && data[2] == 'u')
+            {
+                strncpy(hex, data + 3, 4);
+                const int low = strtol(hex, &end, 16);
+                if (end == hex + 4 && 0xdc00 <= low && low < 0xe000) {
+                    chr = 0x10000 + ((chr - 0xd800) << 10) + (low - 0xdc00);
+                    data += 6;
+                }
+            }
+            *s += utf8_encode(chr);
+            break;
+        }
+        default:
+            return fail("invalid escape '\\%c' in string", *data);
+        }
+        data++;
+    }
+}
+
+bool JsonParser::parseKey(const char** key, size_t *len)
+{
+    if (!parseStringRange(key, len))
+    {
+        if (!parseToken('"'))
+            return fail("expected object key");
+        if (!parseStringContents(&keybuf))
+            return false;
+        *key = keybuf.c_str();
+        *len = keybuf.size();
+    }
+    if (!parseToken(':'))
+        return fail("expected ':' after key '%s'", string(*key, *len).c_str());
+    return true;
+}
+
+bool JsonParser::skipValue()
+{
+    skipSpace();
+    switch (*data)
+    {
+    case '"': {
+        data++;
+        for (; *data != '"'; data++) {
+            if (*data == '\0')
+                return fail("expected closing '\"' while skipping string, got EOF");
+            if (*data == '\\' && data[1] != '\0')
+                data++;
+        }
+        data++;
+        return true;
+    }
+    case '{': {
+        data++;
+        const char* key = NULL;
+        size_t len = 0;
+        while (!parseToken('}')) {
+            if (!parseKey(&key, &len) || !skipValue())
+                return false;
+            parseToken(',');
+        }
+        return true;
+    }
+    case '[': {
+        data++;
+        while (!parseToken(']')) {
+            if (!skipValue())
+                return false;
+            parseToken(',');
+        }
+        return true;
+    }
+    case '\0':
+        return fail("expected value, got EOF");
+    default: {
+        // number, true, false, null
+        const char* ptr = data;
+        while (*data && (str_isalnum(*data) || str_contains("+-.", *data)))
+            data++;
+        return data != ptr || fail("expected value");
+    }
+    }
+}
+
+bool JsonParser::parse(bool *v)
+{
+    skipSpace();
+    if (strncmp(data, "true", 4) == 0) {
+        *v = true;
+        data += 4;
+    } else if (strncmp(data, "false", 5) == 0) {
+        *v = false;
+        data += 5;
+    } else if (str_isdigit(*data) || *data == '-') {
+        // SaveSerializer writes bools as 0 / 1
+        long long val = 0;
+        if (!parseIntegral(&val))
+            return false;
+        if (val != 0 && val != 1)
+            return fail("expected 'true', 'false', 0 or 1, got %lld", val);
+        *v = (val == 1);
+    } else {
+        return fail("expected 'true' or 'false'");
+    }
+    return true;
+}
+
+bool JsonParser::parseIntegral(long long *v)
+{
+    skipSpace();
+    char* end = NULL;
+    const long long val = strtoll(data, &end, 10);
+    if (end == data)
+        return fail("expected integer");
+    if (*end == '.' || *end == 'e' || *end == 'E')
+        return fail("expected integer, got float");
+    data = end;
+    *v = val;
+    return true;
+}
+
+bool JsonParser::parseIntegral(uint64 *v)
+{
+    skipSpace();
+    char* end = NULL;
+    const uint64 val = strtoull(data, &end, 10);
+    if (end == data)
+        return fail("expected integer");
+    if (*end == '.' || *end == 'e' || *end == 'E')
+        return fail("expected integer, got float");
+    data = end;
+    *v = val;
+    return true;
+}
+
+bool JsonParser::parse(double *v)
+{
+    skipSpace();
+    char* end = NULL;
+    const double val = strtod(data, &end);
+    if (end == data)
+        return fail("expected number");
+    data = end;
+    *v = val;
+    return true;
+}
+
+bool JsonParser::parse(float *v)
+{
+    double val = 0;
+    if (!parse(&val))
+        return false;
+    *v = val;
+    return true;
+}
+
+bool JsonParser::parse(string *s)
+{
+    if (!parseToken('"'))
+        return fail("expected string");
+    return parseStringContents(s);
+}
+
+bool JsonParser::parse(Symbol *s)
+{
+    string t;
+    if (!parse(&t))
+        return false;
+    if (t.size() > kSymbolMaxChars)
+    {
+        ReportEarlyf("%s: truncating symbol '%s' to %d chars", fname.c_str(), t.c_str(), (int)kSymbolMaxChars);
+        t.resize(kSymbolMaxChars);
+    }
+    *s = Symbol(t);
+    return true;
+}
+
+bool JsonParser::parse(LispVal *cons, LispEnv *heap)
+{
+    string t;
+    if (!parse(&t))
+        return false;
+    SaveParser sp(t);
+    return sp.parse(cons, heap) || fail("invalid lisp value '%s'", t.c_str());
+}
+
+bool JsonParser::parse(lstring *s)
+{
+    const char* str = NULL;
+    size_t len = 0;
+    if (parseStringRange(&str, &len)) {
+        keybuf.assign(str, len);
+    } else if (!parse(&keybuf)) {
+        return false;
+    }
+    *s = lstring(keybuf);
+    return true;
+}
+
+bool JsonParser::parseE(uint64 *v, const EnumType &e)
+{
+    const char* str = NULL;
+    size_t len = 0;
+    string s;
+
+    const bool list = parseToken('[');
+    do {
+        if (list && parseToken(']'))
+            return true;
+        uint64 val = 0;
+        if (parseStringRange(&str, &len)) {
+            val = e.getVal(str, len);
+            if (val == ~0)
+                val = e.getValUpper(str, len);
+            if (val == ~0)
+                return fail("enum has no member '%s'", string(str, len).c_str());
+        } else if (atToken('"')) {
+            if (!parse(&s))
+                return false;
+            val = e.getVal(s);
+            if (val == ~0)
+                val = e.getValUpper(s);
+            if (val == ~0)
+                return fail("enum has no member '%s'", s.c_str());
+        } else if (!parseIntegral(&val)) {
+            return fail("expected enum member name or integer");
+        }
+        *v |= val;
+    } while (list && (parseToken(','), true));
+    return true;
+}
+
+#define JSON_TEST_KEYS(F)                       \
+    F(ALPHA, 0)                                 \
+    F(BETA,  1)                                 \
+    F(GAMMA, 2)                                 \
+
+DEFINE_ENUM(uchar, EJsonTestKey, JSON_TEST_KEYS);
+
+template <typename T>
+static bool jsonRoundTrip(const T& val)
+{
+    T parsed;
+    return JsonParser::parse(JsonSerializer::toString(val), &parsed) && parsed == val;
+}
+
+bool json_runtests()
+{
+#if IS_DEVEL
+    Report("Beginning Json Tests");
+    std::map<EJsonTestKey, int> emap;
+    emap[EJsonTestKey::ALPHA] = 1;
+    emap[EJsonTestKey::GAMMA] = 3;
+    ASSERTF(jsonRoundTrip(emap), "%s", JsonSerializer::toString(emap).c_str());
+
+    std::map<int, string> imap;
+    imap[-5] = "minus five";
+    imap[12] = "twelve \"quoted\"";
+    ASSERTF(jsonRoundTrip(imap), "%s", JsonSerializer::toString(imap).c_str());
+
+    std::map<string, EJsonTestKey> smap;
+    smap["beta"] = EJsonTestKey::BETA;
+    ASSERTF(jsonRoundTrip(smap), "%s", JsonSerializer::toString(smap).c_str());
+
+    bool flag = false;
+    ASSERT(JsonParser::parse("1", &flag, true) && flag);
+    ASSERT(!JsonParser::parse("10", &flag, true));
+
+    const std::vector<int64> big = { -(1LL << 40), 0, (1LL << 62) };
+    ASSERTF(jsonRoundTrip(big), "%s", JsonSerializer::toString(big).c_str());
+    Report("Ending Json Tests");
+#endif
+    return true;
+}
@@ -0,0 +1,589 @@
+
+#pragma once
+
+//
+// SaveJson.h - compact JSON writer and streaming JSON reader for reflected types
+//
+// SaveSerializer and SaveParser handle JSON through the same token / pretty printing path as
+// lua. These bypass all of that for bulk export / import: JsonSerializer appends straight to a
+// string with no whitespace, and JsonParser reads directly from the buffer without building a
+// document tree, dispatching struct fields through the same accept() visitors.
+//
+// supported: scalars, strings, Symbol, SerialEnum, glm vectors, std containers, copy_ptr,
+// unique_ptr, ref_ptr, sref (as its key), VisitEnabled structs, SaveCustom and VisitProxy
+// types. LispVal is written as a string of its lisp text. Polymorphic (VisitVirtualEnabled)
+// types are not supported.
+
+#include "Save.h"
+
+struct JsonSerializer {
+
+    string o;
+
+    JsonSerializer() {}
+
+    template <typename T>
+    static string toString(const T& v)
+    {
+        JsonSerializer s;
+        s.serialize(v);
+        return std::move(s.o);
+    }
+
+    string&       str()       { return o; }
+    const string& str() const { return o; }
+
+    void serialize(bool v)   { o += v ? "true" : "false"; }
+    void serialize(ReallyBool v) { serialize(v.val); }
+    void serialize(char i)   { appendInt(i); }
+    void serialize(uchar i)  { appendUInt(i); }
+    void serialize(short i)  { appendInt(i); }
+    void serialize(ushort i) { appendUInt(i); }
+    void serialize(int i)    { appendInt(i); }
+    void serialize(uint i)   { appendUInt(i); }
+    void serialize(int64 i)  { appendInt(i); }
+    void serialize(uint64 i) { appendUInt(i); }
+    void serialize(float f);
+    void serialize(double f);
+
+    void serialize(const char* s);
+    void serialize(const string& s) { serialize(s.c_str()); }
+    void serialize(lstring s)       { serialize(s.c_str()); }
+    void serialize(const Symbol &s);
+    void serialize(LispVal cons, const LispEnv *heap=NULL);
+
+    template <typename T>
+    void serialize(const SerialEnum<T> &enm) { serializeE(enm.value, T::getType()); }
+
+    template <typename T> void serialize(const copy_ptr<T>& ptr) { serialize(ptr.get()); }
+    template <typename T> void serialize(const unique_ptr<T>& ptr) { serialize(ptr.get()); }
+    template <typename T> void serialize(const ref_ptr<T>& ptr) { serialize(ptr.get()); }
+    template <typename T, typename K>
+    void serialize(const sref<T, K>& ptr) { serialize(ptr.key); }
+
+    template <typename K, typename V>
+    void serialize(const std::pair<K, V> &v)
+    {
+        o += '[';
+        serialize(v.first);
+        o += ',';
+        serialize(v.second);
+        o += ']';
+    }
+
+    template <typename T> void serialize(const vector<T> &v)   { serializeList(v); }
+    template <typename T> void serialize(const deque<T> &v)    { serializeList(v); }
+    template <typename T> void serialize(const std::set<T> &v) { serializeList(v); }
+    template <typename T> void serialize(const std::unordered_set<T> &v) { serializeList(v); }
+    template <typename T, size_t S> void serialize(const std::array<T, S> &v) { serializeList(v); }
+
+    template <typename K, typename V> void serialize(const std::map<K, V> &v) { serializeMap(v); }
+    template <typename K, typename V> void serialize(const std::unordered_map<K, V> &v) { serializeMap(v); }
+
+    template <typename T>
+    void serialize(const glm::tvec2<T> &v)
+    {
+        o += '['; serialize(v.x); o += ','; serialize(v.y); o += ']';
+    }
+
+    template <typename T>
+    void serialize(const glm::tvec3<T> &v)
+    {
+        o += '['; serialize(v.x); o += ','; serialize(v.y); o += ','; serialize(v.z); o += ']';
+    }
+
+    template <typename T>
+    void serialize(const glm::tvec4<T> &v)
+    {
+        o += '['; serialize(v.x); o += ','; serialize(v.y); o += ',';
+        serialize(v.z); o += ','; serialize(v.w); o += ']';
+    }
+
+    template <typename T>
+    void serialize(const T *val, typename T::VisitEnabled=0) { serializeVisitable(val); }
+    template <typename T>
+    void serialize(const T *val, typename T::VisitIndexedEnabled=0) { serializeVisitable(val); }
+
+    template <typename T>
+    void serialize(const T& val, typename SaveCustom<T>::type *_=NULL) { serialize(val.serialize()); }
+
+    template <typename T>
+    void serialize(const T &val, typename T::VisitProxy* =0) { serialize(val.proxy_serialize()); }
+
+    template <typename T, typename = typename std::enable_if<!std::is_scalar<T>::value &&
+                                                             !SaveCustom<T>::value &&
+                                                             !VisitProxyEnabled<T>::value>::type >
+    void serialize(const T &val)
+    {
+        serialize(&val);
+    }
+
+    // accept() visitor interface
+    template <typename T>
+    bool visit(const char* name, const T &val)
+    {
+        if (!is_default<T>()(val))
+            serializeField(name, val);
+        return true;
+    }
+
+    template <typename T>
+    bool visit(const char* name, const T &val, const T& def)
+    {
+        if (!(val == def))
+            serializeField(name, val);
+        return true;
+    }
+
+    template <typename T>
+    bool visitSkip(const char *name) { return true; }
+
+private:
+
+    void appendInt(long long v);
+    void appendUInt(uint64 v);
+    void appendNonFinite(double f);
+    void serializeE(uint64 v, const EnumType &e);
+
+    // close an object or array, eating the trailing comma
+    void close(char token)
+    {
+        if (o.back() == ',')
+            o.back() = token;
+        else
+            o += token;
+    }
+
+    template <typename T>
+    void serializeField(const char* name, const T& val)
+    {
+        serialize(name);
+        o += ':';
+        serialize(val);
+        o += ',';
+    }
+
+    template <typename T>
+    void serializeList(const T &v)
+    {
+        o += '[';
+        for (const auto &x : v) {
+            serialize(x);
+            o += ',';
+        }
+        close(']');
+    }
+
+    void serializeKey(const char* key)    { serialize(key); }
+    void serializeKey(const string &key)  { serialize(key.c_str()); }
+    void serializeKey(lstring key)        { serialize(key.c_str()); }
+
+    // JSON keys must be strings
+    template <typename K>
+    void serializeKey(const K& key)
+    {
+        const size_t start = o.size();
+        serialize(key);
+        if (o[start] != '"')
+        {
+            const string raw = o.substr(start);
+            o.resize(start);
+            serialize(raw);
+        }
+    }
+
+    template <typename M>
+    void serializeMap(const M& v)
+    {
+        o += '{';
+        for (const auto &it : v) {
+            serializeKey(it.first);
+            o += ':';
+            serialize(it.second);
+            o += ',';
+        }
+        close('}');
+    }
+
+    template <typename T>
+    void serializeVisitable(const T *val)
+    {
+        if (!val) {
+            o += "null";
+            return;
+        }
+        o += '{';
+        const_cast<T*>(val)->accept(*this);
+        close('}');
+    }
+};
+
+
+struct JsonParser {
+
+private:
+    string      fname;
+    const char* start   = NULL;
+    const char* data    = NULL;
+    bool        fail_ok = false;
+    int         error_count = 0;
+    string      keybuf;     // storage for keys containing escapes
+    mutable LineIndex lineIndex;
+
+    template <typename... Args>
+    bool fail(const char* format, const Args & ... args)
+    {
+        if (!fail_ok && error_count++ == 0)
+            ReportEarly(errmsg(str_format(format, args...)));
+        return false;
+    }
+
+    // find the value in VAL named KEY and parse it
+    struct FieldParser {
+        JsonParser  *self;
+        const char*  key;
+        size_t       len;
+        const char*  found = NULL;
+        bool         ok    = true;
+
+        FieldParser(JsonParser *s, const char* k, size_t l) : self(s), key(k), len(l) {}
+
+        bool match(const char* name) const
+        {
+            return strncmp(name, key, len) == 0 && name[len] == '\0';
+        }
+
+        template <typename T>
+        bool visit(const char* name, T &val)
+        {
+            if (!match(name))
+                return true;
+            found = name;
+            ok = self->parse(&val);
+            return false;
+        }
+
+        template <typename T>
+        bool visit(const char* name, T &val, const T& def) { return visit(name, val); }
+
+        template <typename T>
+        bool visitSkip(const char *name)
+        {
+            if (!match(name))
+                return true;
+            found = name;
+            ok = self->skipValue();
+            return false;
+        }
+    };
+
+    bool parseStringContents(string *s);
+    bool parseIntegral(long long *v);
+    bool parseIntegral(uint64 *v);
+
+    template <typename T>
+    bool parseIntegral(T *v)
+    {
+        long long lval = 0;
+        if (!parseIntegral(&lval))
+            return false;
+        if (lval < std::numeric_limits<T>::min() || lval > std::numeric_limits<T>::max())
+            return fail("integer %lld is out of range for %s", lval, TYPE_NAME(T));
+        *v = (T) lval;
+        return true;
+    }
+
+    template <typename T, typename Ins>
+    bool parseList(Ins ins)
+    {
+        if (!parseToken('['))
+            return fail("expected '[' for list of %s", TYPE_NAME(T));
+        while (!parseToken(']'))
+        {
+            T el{};
+            if (!parse(&el))
+                return false;
+            *ins = std::move(el);
+            ++ins;
+            parseToken(',');
+        }
+        return true;
+    }
+
+    template <typename T, size_t S>
+    bool parseFixed(T *v)
+    {
+        if (!parseToken('['))
+            return fail("expected '[' for %s[%d]", TYPE_NAME(T), (int)S);
+        for (size_t i=0; i<S; i++)
+        {
+            if (!parse(&v[i]))
+                return false;
+            parseToken(',');
+        }
+        if (!parseToken(']'))
+            return fail("expected ']' after %d elements", (int)S);
+        return true;
+    }
+
+    bool parseKeyAs(string *k, const char* key, size_t len)  { k->assign(key, len); return true; }
+    bool parseKeyAs(lstring *k, const char* key, size_t len) { *k = lstring(string(key, len)); return true; }
+
+    // JsonSerializer writes keys as their JSON text, quoted unless it already was a string (enums)
+    template <typename K>
+    bool parseKeyAs(K *k, const char* key, size_t len)
+    {
+        const string raw(key, len);
+        if (parseKeyText(k, raw))
+            return true;
+        *k = K();
+        return parseKeyText(k, JsonSerializer::toString(raw)) ||
+            fail("invalid key '%s' for %s", raw.c_str(), TYPE_NAME(K));
+    }
+
+    template <typename K>
+    bool parseKeyText(K *k, const string &text)
+    {
+        JsonParser p(text, fname);
+        p.setFailOk(true);
+        return p.parse(k) && p.isEof();
+    }
+
+    template <typename M>
+    bool parseMap(M* mp)
+    {
+        if (!parseToken('{'))
+            return fail("expected '{' for %s", TYPE_NAME(M));
+        const char* key = NULL;
+        size_t len = 0;
+        while (!parseToken('}'))
+        {
+            typename M::key_type k{};
+            if (!parseKey(&key, &len) || !parseKeyAs(&k, key, len))
+                return false;
+            typename M::mapped_type v{};
+            if (!parse(&v))
+                return false;
+            (*mp)[std::move(k)] = std::move(v);
+            parseToken(',');
+        }
+        return true;
+    }
+
+    template <typename T>
+    bool parseStruct(T *val)
+    {
+        if (!parseToken('{'))
+            return fail("expected '{' for %s", TYPE_NAME(T));
+        const char* key = NULL;
+        size_t len = 0;
+        while (!parseToken('}'))
+        {
+            if (!parseKey(&key, &len))
+                return false;
+            FieldParser fp(this, key, len);
+            val->accept(fp);
+            if (!fp.found) {
+                if (!skipValue())
+                    return false;
+            } else if (!fp.ok) {
+                return fail("while parsing %s.%s", TYPE_NAME(T), fp.found);
+            }
+            parseToken(',');
+        }
+        return true;
+    }
+
+public:
+
+    JsonParser(const char* d, const string &fn="-") : fname(fn), start(d), data(d) {}
+    JsonParser(const string &d, const string &fn="-") : fname(fn), start(d.c_str()), data(d.c_str()) {}
+
+    // return true if DATA completely parses into V
+    template <typename T>
+    static bool parse(const string &data, T *v, bool fok=false)
+    {
+        JsonParser p(data);
+        p.setFailOk(fok);
+        return p.parse(v) && p.isEof();
+    }
+
+    void setFailOk(bool ok) { fail_ok = ok; }
+    int  getErrorCount() const { return error_count; }
+    const char* c_str() const { return data; }
+
+    string errmsg(const string &msg) const;
+
+    // streaming interface. All of these skip leading whitespace
+    void skipSpace() { while (str_isspace(*data)) data++; }
+    bool isEof()     { skipSpace(); return *data == '\0'; }
+    bool atToken(char token) { skipSpace(); return *data == token; }
+    bool parseToken(char token)
+    {
+        skipSpace();
+        if (*data != token)
+            return false;
+        data++;
+        return true;
+    }
+    bool parseNull();
+
+    // parse "key": - KEY points into the buffer or a scratch string, valid until the next key
+    bool parseKey(const char** key, size_t *len);
+
+    // parse "string" without escapes in place. Return false if not a string or has escapes
+    bool parseStringRange(const char** str, size_t *len);
+
+    // skip any value, including nested objects and arrays
+    bool skipValue();
+
+    // typed interface
+    bool parse(bool *v);
+    bool parse(char* v)   { return parseIntegral(v); }
+    bool parse(uchar* v)  { return parseIntegral(v); }
+    bool parse(short* v)  { return parseIntegral(v); }
+    bool parse(ushort* v) { return parseIntegral(v); }
+    bool parse(int* v)    { return parseIntegral(v); }
+    bool parse(uint* v)   { return parseIntegral(v); }
+    bool parse(int64* v)  { return parseIntegral(v); }
+    bool parse(uint64* v) { return parseIntegral(v); }
+    bool parse(ReallyBool *v) { return parse(&v->val); }
+    bool parse(float *v);
+    bool parse(double *v);
+    bool parse(string *s);
+    bool parse(lstring *s);
+    bool parse(Symbol *s);
+    bool parse(LispVal *cons, LispEnv *heap=NULL);
+    bool parseE(uint64 *v, const EnumType &e);
+
+    template <typename T>
+    bool parse(SerialEnum<T> *enm)
+    {
+        uint64 v = 0;
+        if (!parseE(&v, T::getType()))
+            return false;
+        if (v > std::numeric_limits<typename T::value_type>::max())
+            return fail("enum value %#llx is out of range for %s", v, TYPE_NAME(T));
+        enm->value = v;
+        return true;
+    }
+
+    template <typename T>
+    bool parse(copy_ptr<T> *ptr)
+    {
+        if (parseNull()) {
+            ptr->reset();
+            return true;
+        }
+        if (!*ptr)
+            ptr->reset(new T());
+        return parse(ptr->get());
+    }
+
+    template <typename T>
+    bool parse(unique_ptr<T> *ptr)
+    {
+        if (parseNull()) {
+            ptr->reset();
+            return true;
+        }
+        if (!*ptr)
+            ptr->reset(new T());
+        return parse(ptr->get());
+    }
+
+    template <typename T>
+    bool parse(ref_ptr<T> *ptr)
+    {
+        const bool ok = parse(ptr->getPtr());
+        if (ok)
+            copy_refcount(ptr->get(), +1);
+        return ok;
+    }
+
+    template <typename T, typename K>
+    bool parse(sref<T, K> *ptr)
+    {
+        return parse(&ptr->key);
+    }
+
+    template <typename T, typename = typename std::enable_if<std::is_default_constructible<T>::value &&
+                                                            !VisitVirtualEnabled<T>::value>::type>
+    bool parse(T** psb)
+    {
+        if (parseNull()) {
+            *psb = NULL;
+            return true;
+        }
+        if (!*psb)
+            *psb = new T();
+        return parse(*psb);
+    }
+
+    template <typename K, typename V>
+    bool parse(std::pair<K, V> *v)
+    {
+        return (parseToken('[') || fail("expected '[' for pair")) &&
+            parse(&v->first) && (parseToken(','), parse(&v->second)) &&
+            (parseToken(']') || fail("expected ']' after pair"));
+    }
+
+    template <typename T> bool parse(vector<T>* v) { v->clear(); return parseList<T>(back_inserter(*v)); }
+    template <typename T> bool parse(deque<T>* v) { v->clear(); return parseList<T>(back_inserter(*v)); }
+    template <typename T> bool parse(std::set<T>* v) { v->clear(); return parseList<T>(inserter(*v, v->end())); }
+    template <typename T> bool parse(std::unordered_set<T>* v) { v->clear(); return parseList<T>(inserter(*v, v->end())); }
+    template <typename T, size_t S> bool parse(std::array<T, S> *v) { return parseFixed<T, S>(&(*v)[0]); }
+    template <typename K, typename V> bool parse(std::map<K, V>* mp) { return parseMap(mp); }
+    template <typename K, typename V> bool parse(std::unordered_map<K, V>* mp) { return parseMap(mp); }
+
+    template <typename T> bool parse(glm::tvec2<T> *v) { return parseFixed<T, 2>(&v->x); }
+    template <typename T> bool parse(glm::tvec3<T> *v) { return parseFixed<T, 3>(&v->x); }
+    template <typename T> bool parse(glm::tvec4<T> *v) { return parseFixed<T, 4>(&v->x); }
+
+    template <typename T>
+    bool parse(T* val, typename SaveCustom<T>::type *_=NULL)
+    {
+        string s;
+        if (!parse(&s))
+            return false;
+        return val->parse(s.c_str()) != 0 || fail("expected '%s'", TYPE_NAME(T));
+    }
+
+    template <typename T>
+    bool parse(T* val, typename T::VisitProxy prx = typename T::VisitProxy())
+    {
+        return parse(&prx) && (val->proxy_parse(std::move(prx)) || fail("proxy parse failed for %s", TYPE_NAME(T)));
+    }
+
+    template <typename T, typename = typename std::enable_if<!std::is_pointer<T>::value &&
+                                                             !SaveCustom<T>::value &&
+                                                             !VisitProxyEnabled<T>::value>::type>
+    bool parse(T* v)
+    {
+        return parseStruct(v);
+    }
+};
+
+// write data to LOCAL file (not steam cloud) in compact JSON
+template <typename T>
+bool serializeToJsonFile(const string &fname, const T& val)
+{
+    return ZF_SaveFileRaw(fname.c_str(), JsonSerializer::toString(val));
+}
+
+template <typename T>
+LoadStatus loadJsonFileAndParse(const string &fname, T* data)
+{
+    const std::shared_ptr<const string> buf = LoadFileShared(fname);
+    if (!buf || buf->empty())
+        return LS_MISSING;
+    JsonParser p(*buf, fname);
+    if (!p.parse(data))
+        return LS_ERROR;
+    if (!p.isEof())
+        ReportEarly(p.errmsg("garbage at end of file"));
+    return LS_OK;
+}
+
+// round trip self tests for map keys, etc (IS_DEVEL only)
+bool json_runtests();
@@ -53,16 +53,71 @@ struct EnumType {
     std::vector<Pair> elems;
 
 private:
-    std::unordered_map<string, uint64>  s2v;
+    std::vector<uint>                   s2v;      // open addressed name hash -> elems index + 1
+    uint                                s2vMask = 0;
     std::unordered_map<uint64, lstring> v2s;
     bool                                m_isBitset = true;
+
+    // bitset decomposition table, as elems indices in declaration order
+    uint                                m_single[64]; // first member equal to 1<<i, or ~0
+    uint64                              m_singleMask = 0;
+    std::vector<uint>                   m_multi;  // zero and multi bit members
+
+    uint64 lookup(const char* str, size_t len, bool upper) const;
+
 public:
 
     EnumType(std::initializer_list<Pair> el);
 
     lstring getName(uint64 val) const { return map_get(v2s, val); }
-    uint64 getVal(const string &str) const { return map_get(s2v, str, ~0); }
+
+    // exact name lookup, return ~0 if not found. never allocates
+    uint64 getVal(const char* str, size_t len) const { return lookup(str, len, false); }
+    uint64 getVal(const char* str) const { return getVal(str, str_len(str)); }
+    uint64 getVal(const string &str) const { return getVal(str.c_str(), str.size()); }
+
+    // lookup of STR converted to upper case, as the text parsers match names
+    uint64 getValUpper(const char* str, size_t len) const { return lookup(str, len, true); }
+    uint64 getValUpper(const string &str) const { return getValUpper(str.c_str(), str.size()); }
+
     bool isBitset() const { return m_isBitset; }
+
+    // call fun(name, remaining) for each member whose bits are all set in val, in declaration
+    // order, clearing those bits as we go. return leftover bits (0 if completely decomposed)
+    // zero valued members always match, so e.g. NONE is still written as the first component
+    // Only single bit members for bits set in val are visited, plus zero and multi bit members
+    template <typename F>
+    uint64 decompose(uint64 val, const F& fun) const
+    {
+        // candidate single bit members, sorted into declaration order
+        uint singles[64];
+        int count = 0;
+        for (uint64 bits = val & m_singleMask; bits; bits &= bits - 1)
+        {
+            const uint idx = m_single[bit_ctz(bits)];
+            int j = count++;
+            for (; j > 0 && singles[j-1] > idx; j--)
+                singles[j] = singles[j-1];
+            singles[j] = idx;
+        }
+
+        // merge with the zero and multi bit members
+        int s = 0;
+        size_t m = 0;
+        while (s < count || m < m_multi.size())
+        {
+            const uint idx = (m == m_multi.size() || (s < count && singles[s] < m_multi[m])) ?
+                             singles[s++] : m_multi[m++];
+            const Pair &it = elems[idx];
+            if ((val&it.second) != it.second)
+                continue;
+            val &= ~it.second;
+            fun(it.first, val);
+            if (val == 0)
+                break;
+        }
+        return val;
+    }
 };
 
 
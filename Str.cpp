@@ -344,6 +344,13 @@ size_t utf8_width(const string &str, size_t pos, size_t len)
 }
 
 
+// lives here instead of in Lexicon because Str.h is included before stl_ext.h
+static profiled_mutex &lexiconMutex()
+{
+    static profiled_mutex *m = new profiled_mutex("Lexicon");
+    return *m;
+}
+
 lstring::Lexicon & lstring::Lexicon::instance()
 {
     static Lexicon *self = new Lexicon;
@@ -373,7 +380,7 @@ const char* lstring::Lexicon::intern(const char* ptr)
     if (!ptr || ptr[0] == '\0')
         return NULL;
     Lexicon &self = instance();
-    std::lock_guard<std::mutex> l(self.mutex);
+    std::lock_guard<profiled_mutex> l(lexiconMutex());
     auto it = self.strings.find(ptr);
     if (it == self.strings.end())
     {
@@ -831,11 +838,11 @@ std::string lang_colon(const char *a, const std::string &b) { return a + (_(": "
 std::string lang_colon(const std::string &a, const char* b) { return a + _(": ") + b; }
 std::string lang_colon(const char *a, const char* b) { return std::string(a) + _(": ") + b; }
 
-std::string str_bytes_format(int bytes)
+std::string str_bytes_format(long long bytes)
 {
     static const double kilo = 1024.0; // 1000.0
     if (bytes < kilo)
-        return str_format("%d B", bytes);
+        return str_format("%lld B", bytes);
     else if (bytes < kilo * kilo)
         return str_format("%.1f KB", bytes / kilo);
     else if (bytes < kilo * kilo * kilo)
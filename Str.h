@@ -101,8 +101,7 @@ private:
                 return str_equals(a, b);
             }
         };
-        
-        std::mutex                                                mutex;
+
         std::unordered_set<const char*, cstring_hash, cstring_eq> strings;
 
         static const char* intern(const char* ptr);
@@ -651,7 +650,7 @@ std::string lang_colon(const std::string &a, const char* b);
 std::string lang_colon(const char *a, const char* b);
 
 // return data byte size in MB, KB, etc
-std::string str_bytes_format(int bytes);
+std::string str_bytes_format(long long bytes);
 #define FMT_BYTES(X) (str_bytes_format(X).c_str())
 
 std::string str_tohex(const char* digest, int size);
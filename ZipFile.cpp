@@ -5,8 +5,19 @@
 #include <zlib.h>
 #include "../minizip/unzip.h"
 
+#if ZF_HAS_LZ4
+#include <lz4frame.h>
+#endif
+#if ZF_HAS_ZSTD
+#include <zstd.h>
+#endif
+
 static DEFINE_CVAR(bool, kReadZipFiles, false);
 static DEFINE_CVAR(int, kFileSizeMax, 1024 * 1024 * 100);
+static DEFINE_CVAR(int, kLoadDirectoryThreads, 8);
+static DEFINE_CVAR(bool, kLoadDirectoryPrefetch, true);
+static DEFINE_CVAR(int, kZstdLevel, 3);
+static DEFINE_CVAR(int, kLoadCacheMaxBytes, 0);
 
 static void ZF_Report(const char* format, ...)
 {
@@ -34,6 +45,11 @@ static unzFile openZip(const string &fil)
 #define GZ_OPEN(F, M) gzopen((F), (M))
 #define FOPEN(F, M) fopen((F), (M))
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 static unzFile openZip(const string &fil)
 {
     zlib_filefunc64_def ffunc;
@@ -43,30 +59,81 @@ static unzFile openZip(const string &fil)
 
 #endif
 
-typedef pair< unzFile, std::unordered_map<string, unz64_file_pos> > ZipDirectory;
-typedef std::map<std::string, ZipDirectory> ZipFileDir;
-typedef pair<std::string, ZipDirectory> ZipFileEntry;
+// immutable index of a zip central directory. The archive is memory mapped
+// (falling back to positional reads on a shared read-only descriptor), so any
+// number of threads can load from the same archive concurrently without
+// seeking a shared unzFile.
+struct ZipEntry {
+    uint64 offset = 0;          // start of compressed data
+    uint64 csize  = 0;
+    uint64 usize  = 0;
+    uint   method = 0;          // 0 stored, Z_DEFLATED
+    uint   crc    = 0;
+};
+
+struct ZipArchive {
+    string                             path;
+    std::vector<ZipEntry>              entries;
+    std::unordered_map<string, uint>   byPath;     // full path in archive -> entries index
+    std::unordered_map<string, int>    byBasename; // unique basenames only, -1 if ambiguous
+    const char*                        map = NULL; // entire archive, if mapped
+    uint64                             mapSize = 0;
+#if WIN32
+    HANDLE                             handle = INVALID_HANDLE_VALUE;
+    HANDLE                             mapping = NULL;
+#else
+    int                                fd = -1;
+#endif
+
+    ~ZipArchive()
+    {
+#if WIN32
+        if (map)
+            UnmapViewOfFile(map);
+        if (mapping)
+            CloseHandle(mapping);
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle);
+#else
+        if (map)
+            munmap((void*)map, mapSize);
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    bool open();
+    void mapFile();
+    bool readAt(uint64 offset, char* buf, size_t size) const;
+    const ZipEntry *find(const string &prefix, const char* path) const;
+};
+
+typedef std::map<std::string, std::shared_ptr<const ZipArchive> > ZipFileDir;
 
 static ZipFileDir& getZipFileDir()
 {
-    static std::map<std::string, ZipDirectory> zd;
+    static ZipFileDir zd;
     return zd;
 }
 
-static std::mutex &getZipMutex()
+static profiled_mutex &getZipMutex()
 {
-    static std::mutex m;
+    static profiled_mutex m("ZipFile");
     return m;
 }
 
+static void clearLoadCache();
+
 void ZF_ClearCached()
 {
-    std::lock_guard<std::mutex> l(getZipMutex());
+    clearLoadCache();
+    std::lock_guard<profiled_mutex> l(getZipMutex());
     ZipFileDir &zfd = getZipFileDir();
     for_ (ze, zfd)
     {
-        unzClose(ze.second.first);
-        DPRINT(SAVE, ("close cashed %s (%d files)", ze.first.c_str(), (int)ze.second.second.size()));
+        // archives still in use by a loading thread close when it lets go
+        DPRINT(SAVE, ("close cashed %s (%d files)", ze.first.c_str(),
+                      ze.second ? (int)ze.second->entries.size() : 0));
     }
     zfd.clear();
 }
@@ -82,59 +149,279 @@ static string getZipFileName(const char* path)
     return "";
 }
 
-static const ZipDirectory *getZipDir(const char* path)
+bool ZipArchive::open()
 {
-    string zipf = getZipFileName(path);
-    if (!zipf.size())
-        return NULL;
-    
-    zipf = OL_PathForFile(zipf.c_str(), "r");
+#if WIN32
+    handle = CreateFileW(s2ws(path).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        ReportWin32Err1(str_format("CreateFile('%s')", path.c_str()).c_str(), GetLastError(), __FILE__, __LINE__);
+        return false;
+    }
+#else
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        ZF_Report("open '%s' failed: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+#endif
 
-    std::lock_guard<std::mutex> l(getZipMutex());
-    ZipDirectory &zd = getZipFileDir()[zipf];
-    if (zd.first)
-        return &zd;              // already cached
+    mapFile();
 
-    zd.first = openZip(zipf);
+    // walk the central directory once with minizip, recording where each
+    // entry's data starts so reads never touch the unzFile again
+    unzFile uf = openZip(path);
+    if (!uf)
+        return false;
 
     char buf[512];
-    if (unzGoToFirstFile2(zd.first, NULL, buf, arraySize(buf), NULL, 0, NULL, 0) != UNZ_OK)
-        return NULL;            // corrupt?
-    
-    do {
-        unz64_file_pos pos;
-        unzGetFilePos64(zd.first, &pos);
-        zd.second[str_basename(buf)] = pos;
-                        
-    } while (unzGoToNextFile2(zd.first, NULL, buf, arraySize(buf), NULL, 0, NULL, 0) == UNZ_OK);
+    unz_file_info64 info;
+    int stat = unzGoToFirstFile2(uf, &info, buf, arraySize(buf), NULL, 0, NULL, 0);
+    for (; stat == UNZ_OK; stat = unzGoToNextFile2(uf, &info, buf, arraySize(buf), NULL, 0, NULL, 0))
+    {
+        if (str_endswith(buf, "/"))
+            continue;           // directory
+        if ((info.flag&1) || (info.compression_method != 0 && info.compression_method != Z_DEFLATED)) {
+            ZF_Report("skipping encrypted or unsupported entry '%s' in '%s'", buf, path.c_str());
+            continue;
+        }
+        if (unzOpenCurrentFile(uf) != UNZ_OK)
+            continue;
+        ZipEntry ent;
+        ent.offset = unzGetCurrentFileZStreamPos64(uf);
+        ent.csize  = info.compressed_size;
+        ent.usize  = info.uncompressed_size;
+        ent.method = info.compression_method;
+        ent.crc    = info.crc;
+        unzCloseCurrentFile(uf);
+        if (map && ent.offset + ent.csize > mapSize) {
+            ZF_Report("entry '%s' extends past the end of '%s'", buf, path.c_str());
+            continue;
+        }
+
+        const uint idx = entries.size();
+        entries.push_back(ent);
+        byPath[buf] = idx;
 
-    return &zd;
+        int &bn = byBasename.insert(make_pair(str_basename(buf), (int)idx)).first->second;
+        if (bn != (int)idx)
+            bn = -1;
+    }
+    unzClose(uf);
+
+    if (stat != UNZ_END_OF_LIST_OF_FILE)
+        ZF_Report("error reading directory of '%s' (%d), indexed %d files", path.c_str(), stat, (int)entries.size());
+    return true;
 }
 
-static string loadCurrentFile(unzFile uf)
+void ZipArchive::mapFile()
 {
-    string sdata;
+#if WIN32
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+        return;
+    mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping)
+        map = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!map) {
+        ReportWin32Err1(str_format("MapViewOfFile('%s')", path.c_str()).c_str(), GetLastError(), __FILE__, __LINE__);
+        return;
+    }
+    mapSize = size.QuadPart;
+#else
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0)
+        return;
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        ZF_Report("mmap '%s' failed, using pread: %s", path.c_str(), strerror(errno));
+        return;
+    }
+    map = (const char*)ptr;
+    mapSize = st.st_size;
+#endif
+}
 
-    unz_file_info64 info;
-    if (unzGetCurrentFileInfo64(uf, &info, NULL, 0, NULL, 0, NULL, 0) != UNZ_OK)
-        return sdata;
+bool ZipArchive::readAt(uint64 offset, char* buf, size_t size) const
+{
+    if (map)
+    {
+        ASSERT(offset + size <= mapSize);
+        memcpy(buf, map + offset, size);
+        return true;
+    }
+    while (size)
+    {
+#if WIN32
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset     = (DWORD) offset;
+        ov.OffsetHigh = (DWORD) (offset>>32);
+        DWORD read = 0;
+        if (!ReadFile(handle, buf, (DWORD) min(size, (size_t)1<<30), &read, &ov) || read == 0) {
+            ReportWin32Err1(str_format("ReadFile('%s')", path.c_str()).c_str(), GetLastError(), __FILE__, __LINE__);
+            return false;
+        }
+#else
+        const ssize_t read = pread(fd, buf, size, offset);
+        if (read < 0 && errno == EINTR)
+            continue;
+        if (read <= 0) {
+            ZF_Report("pread '%s' failed: %s", path.c_str(), read ? strerror(errno) : "unexpected EOF");
+            return false;
+        }
+#endif
+        buf    += read;
+        offset += read;
+        size   -= read;
+    }
+    return true;
+}
 
-    if (info.uncompressed_size == 0)
-        return sdata;
+const ZipEntry *ZipArchive::find(const string &prefix, const char* path) const
+{
+    // path relative to the zip file, e.g. data/ships.zip contains data/ships/sub/foo.lua as sub/foo.lua
+    if (prefix.size() < strlen(path))
+    {
+        const string rel = path + prefix.size() + 1;
+        const uint *idx = map_addr(byPath, rel);
+        if (!idx)
+            idx = map_addr(byPath, str_path_join(str_basename(prefix), rel));
+        if (idx)
+            return &entries[*idx];
+    }
 
-    if (unzOpenCurrentFile(uf) != UNZ_OK)
-        return sdata;
+    // compatibility with archives flattened by basename
+    const int idx = map_get(byBasename, str_basename(path), -1);
+    return (idx >= 0) ? &entries[idx] : NULL;
+}
+
+static std::shared_ptr<const ZipArchive> getZipArchive(const string &zipf)
+{
+    {
+        std::lock_guard<profiled_mutex> l(getZipMutex());
+        const std::shared_ptr<const ZipArchive> *za = map_addr(getZipFileDir(), zipf);
+        if (za)
+            return *za;         // already cached
+    }
+
+    // index outside the lock. If two threads race, the first one wins
+    // failures are not cached, so a transient error can be retried
+    std::shared_ptr<ZipArchive> arc = std::make_shared<ZipArchive>();
+    arc->path = zipf;
+    if (!arc->open())
+        return NULL;
+
+    std::lock_guard<profiled_mutex> l(getZipMutex());
+    return getZipFileDir().insert(make_pair(zipf, std::shared_ptr<const ZipArchive>(arc))).first->second;
+}
+
+static bool checkOversize(uint64 size, const char* path);
+
+// decompress ENT into DEST, which must hold ent.usize bytes
+static bool readZipEntry(const ZipArchive &arc, const ZipEntry &ent, const char* path, char* dest)
+{
+    if (ent.method == 0)
+    {
+        if (!arc.readAt(ent.offset, dest, ent.usize))
+            return false;
+    }
+    else
+    {
+        // inflate straight out of the mapping when possible
+        string cdata;
+        const char* cptr = arc.map ? arc.map + ent.offset : NULL;
+        if (!cptr)
+        {
+            cdata.resize(ent.csize);
+            if (!arc.readAt(ent.offset, &cdata[0], cdata.size()))
+                return false;
+            cptr = cdata.data();
+        }
 
-    sdata.resize(info.uncompressed_size);
-    int read = unzReadCurrentFile(uf, (void*)sdata.data(), sdata.size());
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        stream.next_in = (Bytef*)cptr;
+        stream.avail_in = (uInt)ent.csize;
+        stream.next_out = (Bytef*)dest;
+        stream.avail_out = (uInt)ent.usize;
+        int stat = inflateInit2(&stream, -MAX_WBITS);
+        if (stat == Z_OK)
+            stat = inflate(&stream, Z_FINISH);
+        inflateEnd(&stream);
+        if (stat != Z_STREAM_END || stream.total_out != ent.usize) {
+            ZF_Report("error inflating '%s' from '%s' (%d): %s", path, arc.path.c_str(),
+                      stat, stream.msg ? stream.msg : "size mismatch");
+            return false;
+        }
+    }
 
-    if (read < sdata.size())
-        sdata.resize(read);
+    if (crc32(crc32(0L, Z_NULL, 0), (const Bytef*)dest, ent.usize) != ent.crc) {
+        ZF_Report("crc mismatch reading '%s' from '%s'", path, arc.path.c_str());
+        return false;
+    }
+    return true;
+}
 
-    unzCloseCurrentFile(uf);
+static string loadZipEntry(const ZipArchive &arc, const ZipEntry &ent, const char* path)
+{
+    string sdata;
+    if (ent.usize == 0 || checkOversize(ent.usize, path))
+        return sdata;
+    sdata.resize(ent.usize);
+    if (!readZipEntry(arc, ent, path, &sdata[0]))
+        return string();
     return sdata;
 }
 
+static std::shared_ptr<const ZipArchive> findZipEntry(const char* path, const ZipEntry **ent)
+{
+    const string zipf = getZipFileName(path);
+    if (!zipf.size())
+        return NULL;
+    std::shared_ptr<const ZipArchive> arc = getZipArchive(OL_PathForFile(zipf.c_str(), "r"));
+    if (!arc)
+        return NULL;
+    *ent = arc->find(zipf.substr(0, zipf.size() - 4), path);
+    if (!*ent)
+        return NULL;
+    DPRINT(SAVE, ("load %s/%s", zipf.c_str(), str_basename(path).c_str()));
+    return arc;
+}
+
+ZFView ZF_ViewZipFile(const char* path, string *buf)
+{
+    ZFView view;
+    const ZipEntry *ent = NULL;
+    std::shared_ptr<const ZipArchive> arc = findZipEntry(path, &ent);
+    if (!arc || ent->usize == 0)
+        return view;
+
+    if (ent->method == 0 && arc->map)
+    {
+        // zero copy. Bounds were checked when indexing
+        const char* data = arc->map + ent->offset;
+        if (crc32(crc32(0L, Z_NULL, 0), (const Bytef*)data, ent->usize) != ent->crc) {
+            ZF_Report("crc mismatch reading '%s' from '%s'", path, arc->path.c_str());
+            return view;
+        }
+        view.data   = data;
+        view.size   = ent->usize;
+        view.mapped = true;
+        view.owner  = arc;
+        return view;
+    }
+
+    if (checkOversize(ent->usize, path))
+        return view;
+    buf->resize(ent->usize);
+    if (!readZipEntry(*arc, *ent, path, &(*buf)[0]))
+        return view;
+    view.data = buf->data();
+    view.size = buf->size();
+    return view;
+}
+
 static gzFile openGzip(const char* path, const char* mode)
 {
     string gzp = str_endswith(path, ".gz") ? string(path) : str_concat(path, ".gz");
@@ -155,16 +442,16 @@ static gzFile openGzip(const char* path, const char* mode)
     return gzf;
 }
 
-static bool checkOversize(int size, const char* path)
+static bool checkOversize(uint64 size, const char* path)
 {
-    const bool oversized = (size > kFileSizeMax);
+    const bool oversized = (size > (uint64)kFileSizeMax);
     if (oversized)
         ZF_Report("aborted reading '%s': size %s is greater than kFileSizeMax (%s)",
                   path, str_bytes_format(size).c_str(), str_bytes_format(kFileSizeMax).c_str());
     return oversized;
 }
 
-string ZF_LoadFile(const char* path)
+static string loadFileUncached(const char* path)
 {
     // 1. read gziped file
     gzFile gzf = openGzip(path, "r");
@@ -196,26 +483,215 @@ string ZF_LoadFile(const char* path)
         return string();
     }
 
-    // 2. read uncompressed file
+    // 2. read lz4 or zstd compressed file
+    for (int codec=ZF_LZ4; codec<ZF_CODEC_COUNT; codec++)
+    {
+        if (!ZF_CodecAvailable((ZFCodec)codec))
+            continue;
+        const string cpath = str_concat(path, ZF_CodecExtension((ZFCodec)codec));
+        if (!OL_FileDirectoryPathExists(cpath.c_str()))
+            continue;
+        const string cdata = ZF_LoadFileRaw(cpath.c_str());
+        if (ZF_DetectCodec(cdata.data(), cdata.size()) == codec)
+        {
+            DPRINT(SAVE, ("load %s %s", ZF_CodecName((ZFCodec)codec), cpath.c_str()));
+            return ZF_Decompress(cdata);
+        }
+    }
+
+    // 3. read uncompressed file
     string buf = ZF_LoadFileRaw(path);
     if (buf.size())
-    {
         return buf;
-    }
 
     if (!kReadZipFiles)
         return string();
 
-    // 3. read zip file
-    const ZipDirectory *zd = getZipDir(path);
-    if (!zd)
+    // 4. read zip file
+    const ZipEntry *ent = NULL;
+    std::shared_ptr<const ZipArchive> arc = findZipEntry(path, &ent);
+    if (!arc)
         return "";
-    const unz64_file_pos &pos = map_get(zd->second, str_basename(path));
-    if (!pos.pos_in_zip_directory)
-        return "";
-    unzGoToFilePos64(zd->first, &pos);
-    DPRINT(SAVE, ("load %s/%s", getZipFileName(path).c_str(), str_basename(path).c_str()));
-    return loadCurrentFile(zd->first);
+    return loadZipEntry(*arc, *ent, path);
+}
+
+// decompressed file cache
+struct LoadCacheEntry {
+    string                                source; // file data was loaded from
+    uint64                                mtime = 0;
+    uint64                                size  = 0;
+    std::shared_ptr<const string>         data;
+    std::list<string>::iterator           lru;
+};
+
+struct LoadCache {
+    std::mutex                                      mutex;
+    std::unordered_map<string, LoadCacheEntry>      entries;
+    std::list<string>                               lru; // most recent first
+    ZFCacheStats                                    stats;
+
+    void erase(std::unordered_map<string, LoadCacheEntry>::iterator it)
+    {
+        stats.bytes -= it->second.data->size();
+        lru.erase(it->second.lru);
+        entries.erase(it);
+    }
+};
+
+static LoadCache &getLoadCache()
+{
+    static LoadCache *cache = new LoadCache;
+    return *cache;
+}
+
+static void clearLoadCache()
+{
+    LoadCache &lc = getLoadCache();
+    std::lock_guard<std::mutex> l(lc.mutex);
+    lc.entries.clear();
+    lc.lru.clear();
+    lc.stats.bytes = 0;
+}
+
+// MTIME is the modification time in the finest units the platform offers (100ns on
+// windows, ns elsewhere), so a same size rewrite within a second still invalidates
+static bool statFile(const char* path, uint64 *mtime, uint64 *size)
+{
+    const char* abspath = OL_PathForFile(path, "r");
+#if WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesExW(s2ws(abspath).c_str(), GetFileExInfoStandard, &fad))
+        return false;
+    *mtime = ((uint64)fad.ftLastWriteTime.dwHighDateTime<<32) | fad.ftLastWriteTime.dwLowDateTime;
+    *size = ((uint64)fad.nFileSizeHigh<<32) | fad.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(abspath, &st))
+        return false;
+#if __APPLE__
+    const struct timespec &ts = st.st_mtimespec;
+#else
+    const struct timespec &ts = st.st_mtim;
+#endif
+    *mtime = (uint64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    *size = st.st_size;
+#endif
+    return true;
+}
+
+// find the file ZF_LoadFile would read PATH from, in the same order
+static bool getLoadSource(const char* path, LoadCacheEntry *ent)
+{
+    string gzp = str_endswith(path, ".gz") ? string(path) : str_concat(path, ".gz");
+    if (statFile(gzp.c_str(), &ent->mtime, &ent->size)) {
+        ent->source = std::move(gzp);
+        return true;
+    }
+    if (str_endswith(path, ".gz"))
+        return false;
+
+    for (int codec=ZF_LZ4; codec<ZF_CODEC_COUNT; codec++)
+    {
+        if (!ZF_CodecAvailable((ZFCodec)codec))
+            continue;
+        string cpath = str_concat(path, ZF_CodecExtension((ZFCodec)codec));
+        if (statFile(cpath.c_str(), &ent->mtime, &ent->size)) {
+            ent->source = std::move(cpath);
+            return true;
+        }
+    }
+
+    if (statFile(path, &ent->mtime, &ent->size)) {
+        ent->source = path;
+        return true;
+    }
+
+    if (!kReadZipFiles)
+        return false;
+    string zipf = getZipFileName(path);
+    if (zipf.size() && statFile(zipf.c_str(), &ent->mtime, &ent->size)) {
+        ent->source = std::move(zipf);
+        return true;
+    }
+    return false;
+}
+
+std::shared_ptr<const string> ZF_LoadFileShared(const char* path)
+{
+    LoadCache &lc = getLoadCache();
+    LoadCacheEntry ent;
+    const bool cacheable = (kLoadCacheMaxBytes > 0) && getLoadSource(path, &ent);
+
+    if (cacheable)
+    {
+        std::lock_guard<std::mutex> l(lc.mutex);
+        auto it = lc.entries.find(path);
+        if (it != lc.entries.end())
+        {
+            const LoadCacheEntry &ce = it->second;
+            if (ce.source == ent.source && ce.mtime == ent.mtime && ce.size == ent.size)
+            {
+                lc.stats.hits++;
+                lc.lru.splice(lc.lru.begin(), lc.lru, ce.lru);
+                return ce.data;
+            }
+            lc.erase(it);       // stale
+        }
+        lc.stats.misses++;
+    }
+
+    string data = loadFileUncached(path);
+    if (data.empty())
+        return NULL;
+    std::shared_ptr<const string> sdata = std::make_shared<const string>(std::move(data));
+    if (!cacheable || sdata->size() > (uint64)kLoadCacheMaxBytes)
+        return sdata;
+
+    // don't cache under the old key if the file was replaced while loading
+    LoadCacheEntry after;
+    if (!getLoadSource(path, &after) || after.source != ent.source ||
+        after.mtime != ent.mtime || after.size != ent.size)
+        return sdata;
+
+    std::lock_guard<std::mutex> l(lc.mutex);
+    if (map_contains(lc.entries, path))
+        return sdata;           // another thread loaded it first
+    lc.lru.push_front(path);
+    ent.data = sdata;
+    ent.lru = lc.lru.begin();
+    lc.stats.bytes += sdata->size();
+    lc.entries[path] = std::move(ent);
+
+    while (lc.stats.bytes > (uint64)kLoadCacheMaxBytes && lc.lru.size() > 1)
+        lc.erase(lc.entries.find(lc.lru.back()));
+    return sdata;
+}
+
+string ZF_LoadFile(const char* path)
+{
+    if (kLoadCacheMaxBytes <= 0)
+        return loadFileUncached(path);
+    std::shared_ptr<const string> data = ZF_LoadFileShared(path);
+    return data ? *data : string();
+}
+
+ZFCacheStats ZF_GetCacheStats()
+{
+    LoadCache &lc = getLoadCache();
+    std::lock_guard<std::mutex> l(lc.mutex);
+    ZFCacheStats stats = lc.stats;
+    stats.entries = lc.entries.size();
+    return stats;
+}
+
+string ZF_CacheReport()
+{
+    const ZFCacheStats st = ZF_GetCacheStats();
+    return str_format("load cache: %d files, %s of %s, %llu hits %llu misses (%.1f%% hit ratio)",
+                      (int)st.entries, str_bytes_format(st.bytes).c_str(),
+                      str_bytes_format(kLoadCacheMaxBytes).c_str(),
+                      (unsigned long long)st.hits, (unsigned long long)st.misses,
+                      100.0 * st.hitRatio());
 }
 
 string ZF_LoadFileRaw(const char *path)
@@ -345,29 +821,92 @@ bool ZF_SaveFileRaw(const char* path, const char* data, size_t size)
 }
 
 
+// call fun(i) for i in [0, count) on up to THREADS threads, including the
+// calling thread. Progress is only written from the calling thread.
+template <typename F>
+static void loadParallel(int count, int threads, float* progress, const F& fun)
+{
+    // helpers run on the job system, whose persistent workers drain their autorelease
+    // pools (OL_PathForFile) when they go idle. This thread loads too and reports progress
+    std::atomic<int> next(0);
+    std::atomic<int> done(0);
+    auto work = [&]() {
+        for (int i; (i = next++) < count; )
+        {
+            fun(i);
+            done++;
+        }
+    };
+
+    std::vector<JobRef> jobs;
+    const int helpers = (threads > 1 && count > 1) ? min(min(threads, count), job_worker_count() + 1) - 1 : 0;
+    for (int i=0; i<helpers; i++)
+        jobs.push_back(job_submit(work));
+
+    for (int i; (i = next++) < count; )
+    {
+        fun(i);
+        const int d = ++done;
+        if (progress)
+            *progress = (float) (d - 1) / count;
+    }
+
+    for (const JobRef &job : jobs)
+        job_wait(job);
+    if (progress && count)
+        *progress = (float) (count - 1) / count;
+}
+
+// ask the kernel to start reading files we are about to load
+static void prefetchFiles(const std::vector<string> &fnames)
+{
+#if __linux__
+    if (!kLoadDirectoryPrefetch)
+        return;
+    for (const string &fname : fnames)
+    {
+        const int fd = ::open(OL_PathForFile(fname.c_str(), "r"), O_RDONLY);
+        if (fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#endif
+}
+
 ZFDirMap ZF_LoadDirectory(const char* path, float* progress)
+{
+    return ZF_LoadDirectoryParallel(path, progress, 1);
+}
+
+ZFDirMap ZF_LoadDirectoryParallel(const char* path, float* progress, int threads)
 {
     ZFDirMap dir;
-    
-    const char** files = OL_ListDirectory(path);
-    if (files)
-    {
-        int count = 0;
-        for (const char** ptr=files; *ptr; ptr++)
-            count++;
-        int i=0;
-        for (const char** ptr=files; *ptr; ptr++)
+    if (threads <= 0)
+        threads = clamp(OL_GetCpuCount(), 1, max(1, (int)kLoadDirectoryThreads));
+
+    const std::vector<string> names = OL_ListDirectoryFiles(path);
+    if (names.size())
+    {
+        std::vector<string> fnames;
+        for (const string &name : names)
+            fnames.push_back(str_path_join(path, name));
+
+        if (threads > 1)
+            prefetchFiles(fnames);
+
+        std::vector<string> datas(fnames.size());
+        loadParallel(fnames.size(), threads, progress, [&](int i) {
+                datas[i] = ZF_LoadFile(fnames[i].c_str());
+            });
+
+        for (int i=0; i<fnames.size(); i++)
         {
-            string fname = str_path_join(path, *ptr);
-            string data = ZF_LoadFile(fname.c_str());
-            if (data.size()) {
-                dir[std::move(fname)] = std::move(data);
+            if (datas[i].size()) {
+                dir[std::move(fnames[i])] = std::move(datas[i]);
             } else {
-                ZF_Report("Error loading '%s' from '%s'", *ptr, path);
+                ZF_Report("Error loading '%s' from '%s'", names[i].c_str(), path);
             }
-            if (progress)
-                *progress = (float) i / count;
-            i++;
         }
         return dir;
     }
@@ -380,24 +919,222 @@ ZFDirMap ZF_LoadDirectory(const char* path, float* progress)
         return dir;
     zipf = OL_PathForFile(zipf.c_str(), "r");
 
-    unzFile uf = openZip(zipf);
-    if (!uf)
+    std::shared_ptr<const ZipArchive> arc = getZipArchive(zipf);
+    if (!arc)
         return dir;
-    char buf[512];
-    if (unzGoToFirstFile2(uf, NULL, buf, arraySize(buf), NULL, 0, NULL, 0) != UNZ_OK)
-        goto done;
-    dir[buf] = loadCurrentFile(uf);
 
-    while (unzGoToNextFile2(uf, NULL, buf, arraySize(buf), NULL, 0, NULL, 0) == UNZ_OK)
+    std::vector<const std::pair<const string, uint>*> ents;
+    for (const std::pair<const string, uint> &it : arc->byPath)
+        ents.push_back(&it);
+
+    std::vector<string> datas(ents.size());
+    loadParallel(ents.size(), threads, NULL, [&](int i) {
+            datas[i] = loadZipEntry(*arc, arc->entries[ents[i]->second], ents[i]->first.c_str());
+        });
+
+    for (int i=0; i<ents.size(); i++)
+        dir[ents[i]->first] = std::move(datas[i]);
+
+    DPRINT(SAVE, ("load %s", zipf.c_str()));
+    return dir;
+}
+
+bool ZFReader::open(const char* path)
+{
+    close();
+    m_path = path;
+    // gzread reads uncompressed files transparently
+    m_gzf = openGzip(path, "r");
+    if (!m_gzf && !str_endswith(path, ".gz"))
+        m_gzf = GZ_OPEN(OL_PathForFile(path, "r"), "rb");
+    return m_gzf != NULL;
+}
+
+int ZFReader::read(char* buf, size_t size)
+{
+    if (!m_gzf)
+        return -1;
+    const int read = gzread(m_gzf, buf, (unsigned)min(size, (size_t)INT_MAX));
+    if (read < 0)
+        ZF_Report("Error reading '%s': %s", m_path.c_str(), gzerror(m_gzf, NULL));
+    return read;
+}
+
+bool ZFReader::readLine(string *line)
+{
+    line->clear();
+    if (!m_gzf)
+        return false;
+    char buf[1024];
+    while (gzgets(m_gzf, buf, sizeof(buf)))
     {
-        dir[buf] = loadCurrentFile(uf);
+        *line += buf;
+        if (line->back() == '\n')
+            return true;
     }
+    return line->size() > 0;
+}
 
-    DPRINT(SAVE, ("load %s", zipf.c_str()));
+void ZFReader::close()
+{
+    if (m_gzf)
+        gzclose(m_gzf);
+    m_gzf = NULL;
+}
 
-done:
-    unzClose(uf);
-    return dir;
+bool ZF_LoadFileChunked(const char* path, const ZFChunkFunc &func, size_t chunk)
+{
+    ZFReader rd(path);
+    if (!rd.isOpen())
+        return false;
+    string buf;
+    buf.resize(chunk);
+    int read = 0;
+    while ((read = rd.read(&buf[0], buf.size())) > 0)
+    {
+        if (!func(buf.data(), read))
+            return true;
+    }
+    return read == 0;
+}
+
+bool ZFWriter::open(const char* path)
+{
+    close();
+    m_path = path;
+    m_ok = true;
+    m_gzf = openGzip(path, "w");
+    if (!m_gzf)
+        ZF_Report("Failed to open '%s' for writing: %s", path, strerror(errno));
+    return m_gzf != NULL;
+}
+
+bool ZFWriter::write(const char* data, size_t size)
+{
+    if (!m_gzf)
+        return false;
+    while (size && m_ok)
+    {
+        const unsigned len = (unsigned)min(size, (size_t)INT_MAX);
+        const int written = gzwrite(m_gzf, data, len);
+        if (written != len) {
+            ZF_Report("gzwrite wrote %d of %d bytes to '%s'", written, (int)len, m_path.c_str());
+            m_ok = false;
+        }
+        data += len;
+        size -= len;
+    }
+    return m_ok;
+}
+
+bool ZFWriter::close()
+{
+    if (!m_gzf)
+        return m_ok;
+    const int stat = gzclose(m_gzf);
+    m_gzf = NULL;
+    if (stat != Z_OK) {
+        ZF_Report("gzclose '%s' failed (%d)", m_path.c_str(), stat);
+        m_ok = false;
+    }
+    DPRINT(SAVE, ("save gzip %s", m_path.c_str()));
+    return m_ok;
+}
+
+ZFInflater::ZFInflater(const ZFChunkFunc &out, size_t chunk) : m_out(out)
+{
+    m_buf.resize(chunk);
+    m_stream = new z_stream;
+    memset(m_stream, 0, sizeof(z_stream));
+    const int stat = inflateInit2(m_stream, 15 + 16);
+    ASSERTF(stat == Z_OK, "inflateInit2 (%d)", stat);
+    m_ok = (stat == Z_OK);
+}
+
+ZFInflater::~ZFInflater()
+{
+    inflateEnd(m_stream);
+    delete m_stream;
+}
+
+bool ZFInflater::feed(const char* data, size_t size)
+{
+    if (!m_ok)
+        return false;
+    m_stream->next_in = (Bytef*)data;
+    m_stream->avail_in = (uInt)size;
+    while (!m_done && (m_stream->avail_in || m_stream->avail_out == 0))
+    {
+        m_stream->next_out = (Bytef*)&m_buf[0];
+        m_stream->avail_out = (uInt)m_buf.size();
+        const int stat = inflate(m_stream, Z_NO_FLUSH);
+        if (stat != Z_OK && stat != Z_STREAM_END && stat != Z_BUF_ERROR) {
+            ZF_Report("inflate error (%d): %s", stat, m_stream->msg);
+            m_ok = false;
+            return false;
+        }
+        m_done = (stat == Z_STREAM_END);
+        const size_t written = m_buf.size() - m_stream->avail_out;
+        if (written && !m_out(m_buf.data(), written)) {
+            m_ok = false;
+            return false;
+        }
+        if (stat == Z_BUF_ERROR)
+            break;              // need more input
+    }
+    return true;
+}
+
+ZFDeflater::ZFDeflater(const ZFChunkFunc &out, size_t chunk) : m_out(out)
+{
+    m_buf.resize(chunk);
+    m_stream = new z_stream;
+    memset(m_stream, 0, sizeof(z_stream));
+    const int stat = deflateInit2(m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    ASSERTF(stat == Z_OK, "deflateInit2 (%d)", stat);
+    m_ok = (stat == Z_OK);
+}
+
+ZFDeflater::~ZFDeflater()
+{
+    deflateEnd(m_stream);
+    delete m_stream;
+}
+
+bool ZFDeflater::deflate1(int flush)
+{
+    int stat = Z_OK;
+    do {
+        m_stream->next_out = (Bytef*)&m_buf[0];
+        m_stream->avail_out = (uInt)m_buf.size();
+        stat = deflate(m_stream, flush);
+        if (stat == Z_STREAM_ERROR) {
+            ZF_Report("deflate error (%d): %s", stat, m_stream->msg);
+            return (m_ok = false);
+        }
+        const size_t written = m_buf.size() - m_stream->avail_out;
+        if (written && !m_out(m_buf.data(), written))
+            return (m_ok = false);
+    } while (m_stream->avail_out == 0 || (flush == Z_FINISH && stat != Z_STREAM_END));
+    return true;
+}
+
+bool ZFDeflater::feed(const char* data, size_t size)
+{
+    if (!m_ok)
+        return false;
+    m_stream->next_in = (Bytef*)data;
+    m_stream->avail_in = (uInt)size;
+    return deflate1(Z_NO_FLUSH);
+}
+
+bool ZFDeflater::finish()
+{
+    if (!m_ok)
+        return false;
+    m_stream->next_in = NULL;
+    m_stream->avail_in = 0;
+    return deflate1(Z_FINISH);
 }
 
 static string closeDeflate(z_stream &stream, string&& str)
@@ -450,10 +1187,8 @@ string ZF_Compress(const char* data, size_t size)
     return closeDeflate(stream, std::move(dest));
 }
 
-string ZF_Decompress(const char* data, size_t size)
+static string gzipDecompress(const char* data, size_t size)
 {
-    if (!data || size == 0)
-        return string();
     z_stream stream;
     memset(&stream, 0, sizeof(stream));
     int stat = 0;
@@ -487,3 +1222,251 @@ string ZF_Decompress(const char* data, size_t size)
     dest.resize(stream.total_out);
     return closeInflate(stream, std::move(dest));
 }
+
+bool ZF_CodecAvailable(ZFCodec codec)
+{
+    switch (codec)
+    {
+    case ZF_GZIP: return true;
+    case ZF_LZ4:  return ZF_HAS_LZ4;
+    case ZF_ZSTD: return ZF_HAS_ZSTD;
+    default:      return false;
+    }
+}
+
+const char* ZF_CodecName(ZFCodec codec)
+{
+    static const char* names[] = { "gzip", "lz4", "zstd" };
+    return (0 <= codec && codec < ZF_CODEC_COUNT) ? names[codec] : "unknown";
+}
+
+const char* ZF_CodecExtension(ZFCodec codec)
+{
+    static const char* exts[] = { ".gz", ".lz4", ".zst" };
+    return (0 <= codec && codec < ZF_CODEC_COUNT) ? exts[codec] : "";
+}
+
+int ZF_DetectCodec(const char* data, size_t size)
+{
+    const uchar *ptr = (const uchar*) data;
+    if (size >= 2 && ptr[0] == 0x1f && ptr[1] == 0x8b)
+        return ZF_GZIP;
+    if (size >= 4 && ptr[0] == 0x04 && ptr[1] == 0x22 && ptr[2] == 0x4d && ptr[3] == 0x18)
+        return ZF_LZ4;
+    if (size >= 4 && ptr[0] == 0x28 && ptr[1] == 0xb5 && ptr[2] == 0x2f && ptr[3] == 0xfd)
+        return ZF_ZSTD;
+    return -1;
+}
+
+#if ZF_HAS_LZ4
+
+static string lz4Compress(const char* data, size_t size)
+{
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.contentSize = size;
+
+    string dest;
+    dest.resize(LZ4F_compressFrameBound(size, &prefs));
+    const size_t written = LZ4F_compressFrame(&dest[0], dest.size(), data, size, &prefs);
+    if (LZ4F_isError(written)) {
+        ZF_Report("LZ4F_compressFrame failed: %s", LZ4F_getErrorName(written));
+        return string();
+    }
+    dest.resize(written);
+    return dest;
+}
+
+static string lz4Decompress(const char* data, size_t size)
+{
+    LZ4F_dctx *ctx = NULL;
+    size_t stat = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+    if (LZ4F_isError(stat)) {
+        ZF_Report("LZ4F_createDecompressionContext failed: %s", LZ4F_getErrorName(stat));
+        return string();
+    }
+
+    LZ4F_frameInfo_t info;
+    size_t consumed = size;
+    stat = LZ4F_getFrameInfo(ctx, &info, data, &consumed);
+    if (LZ4F_isError(stat) || checkOversize(info.contentSize, "lz4 frame")) {
+        if (LZ4F_isError(stat))
+            ZF_Report("LZ4F_getFrameInfo failed: %s", LZ4F_getErrorName(stat));
+        LZ4F_freeDecompressionContext(ctx);
+        return string();
+    }
+
+    string dest;
+    dest.resize(info.contentSize ? info.contentSize : 4 * size);
+    size_t written = 0;
+    while (!LZ4F_isError(stat) && stat != 0)
+    {
+        if (written == dest.size())
+        {
+            if (checkOversize(2 * dest.size(), "lz4 frame")) {
+                LZ4F_freeDecompressionContext(ctx);
+                return string();
+            }
+            dest.resize(2 * dest.size());
+        }
+        size_t dstSize = dest.size() - written;
+        size_t srcSize = size - consumed;
+        stat = LZ4F_decompress(ctx, &dest[written], &dstSize, data + consumed, &srcSize, NULL);
+        written  += dstSize;
+        consumed += srcSize;
+        if (srcSize == 0 && dstSize == 0 && consumed == size)
+            break;              // truncated
+    }
+    LZ4F_freeDecompressionContext(ctx);
+
+    if (stat != 0) {
+        ZF_Report("LZ4F_decompress failed: %s", LZ4F_isError(stat) ? LZ4F_getErrorName(stat) : "truncated frame");
+        return string();
+    }
+    dest.resize(written);
+    return dest;
+}
+
+#endif
+
+#if ZF_HAS_ZSTD
+
+static string zstdCompress(const char* data, size_t size)
+{
+    string dest;
+    dest.resize(ZSTD_compressBound(size));
+    const size_t written = ZSTD_compress(&dest[0], dest.size(), data, size, kZstdLevel);
+    if (ZSTD_isError(written)) {
+        ZF_Report("ZSTD_compress failed: %s", ZSTD_getErrorName(written));
+        return string();
+    }
+    dest.resize(written);
+    return dest;
+}
+
+static string zstdDecompress(const char* data, size_t size)
+{
+    string dest;
+    const unsigned long long usize = ZSTD_getFrameContentSize(data, size);
+    if (usize == ZSTD_CONTENTSIZE_ERROR) {
+        ZF_Report("ZSTD_getFrameContentSize failed: invalid frame header");
+        return string();
+    }
+    if (usize != ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        if (checkOversize(usize, "zstd frame"))
+            return string();
+        dest.resize(usize);
+        const size_t written = ZSTD_decompress(&dest[0], dest.size(), data, size);
+        if (ZSTD_isError(written)) {
+            ZF_Report("ZSTD_decompress failed: %s", ZSTD_getErrorName(written));
+            return string();
+        }
+        dest.resize(written);
+        return dest;
+    }
+
+    // streamed frame with no size in the header
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_initDStream(stream);
+    ZSTD_inBuffer in = { data, size, 0 };
+    dest.resize(4 * size);
+    size_t written = 0;
+    size_t stat = 1;
+    while (stat != 0)
+    {
+        if (written == dest.size())
+        {
+            if (checkOversize(2 * dest.size(), "zstd frame")) {
+                ZSTD_freeDStream(stream);
+                return string();
+            }
+            dest.resize(2 * dest.size());
+        }
+        ZSTD_outBuffer out = { &dest[0], dest.size(), written };
+        stat = ZSTD_decompressStream(stream, &out, &in);
+        written = out.pos;
+        // output space left over means the decoder wants more input than we have
+        if (ZSTD_isError(stat) || (in.pos == in.size && out.pos < out.size))
+            break;
+    }
+    ZSTD_freeDStream(stream);
+
+    if (stat != 0) {
+        ZF_Report("ZSTD_decompressStream failed: %s", ZSTD_isError(stat) ? ZSTD_getErrorName(stat) : "truncated frame");
+        return string();
+    }
+    dest.resize(written);
+    return dest;
+}
+
+#endif
+
+string ZF_Compress(const char* data, size_t size, ZFCodec codec)
+{
+    switch (codec)
+    {
+#if ZF_HAS_LZ4
+    case ZF_LZ4:  return lz4Compress(data, size);
+#endif
+#if ZF_HAS_ZSTD
+    case ZF_ZSTD: return zstdCompress(data, size);
+#endif
+    default:      return ZF_Compress(data, size);
+    }
+}
+
+string ZF_Decompress(const char* data, size_t size)
+{
+    if (!data || size == 0)
+        return string();
+    switch (ZF_DetectCodec(data, size))
+    {
+#if ZF_HAS_LZ4
+    case ZF_LZ4:  return lz4Decompress(data, size);
+#endif
+#if ZF_HAS_ZSTD
+    case ZF_ZSTD: return zstdDecompress(data, size);
+#endif
+    default:      return gzipDecompress(data, size);
+    }
+}
+
+// ZF_LoadFile prefers .gz, so an older save in another codec would shadow the new one
+static void removeOtherCodecs(const char* path, ZFCodec codec)
+{
+    for (int i=0; i<ZF_CODEC_COUNT; i++)
+    {
+        if (i == codec)
+            continue;
+        const string cpath = str_concat(path, ZF_CodecExtension((ZFCodec)i));
+        if (OL_FileDirectoryPathExists(cpath.c_str()) &&
+            remove(OL_PathForFile(cpath.c_str(), "w")))
+        {
+            ZF_Report("error removing stale '%s': %s", cpath.c_str(), strerror(errno));
+        }
+    }
+}
+
+bool ZF_SaveFile(const char* path, const char* data, size_t size, ZFCodec codec)
+{
+    if (!ZF_CodecAvailable(codec))
+        codec = ZF_GZIP;
+    bool success = false;
+    if (codec == ZF_GZIP)
+    {
+        success = ZF_SaveFile(path, data, size);
+    }
+    else
+    {
+        // never replace a good save with an empty file
+        const string cdata = ZF_Compress(data, size, codec);
+        if (cdata.empty())
+            ZF_Report("not saving '%s': %s compression failed", path, ZF_CodecName(codec));
+        else
+            success = ZF_SaveFileRaw(str_concat(path, ZF_CodecExtension(codec)).c_str(), cdata);
+    }
+    if (success)
+        removeOtherCodecs(path, codec);
+    return success;
+}
@@ -4,19 +4,60 @@
 
 // transparently load files from gziped or zip files, in this order
 // 1. data/ships/foo.lua.gz
-// 2. data/ships/foo.lua
-// 3. data/ships.zip/foo.lua
+// 2. data/ships/foo.lua.lz4 or data/ships/foo.lua.zst (see ZFCodec)
+// 3. data/ships/foo.lua
+// 4. data/ships.zip/foo.lua
 
 // read file, gzip compressed file, or file in zip file
 string ZF_LoadFile(const char* path);
 inline string ZF_LoadFile(const string &path) { return ZF_LoadFile(path.c_str()); }
 
+// view of a file inside a zip archive. Entries stored
+// without compression point directly into the memory mapped archive, which
+// stays mapped while the view (or a copy of it) is alive. Deflated entries
+// are inflated into the caller's buffer, which can be reused between calls.
+// Both kinds are crc checked before returning.
+// - DATA is NOT NUL terminated when MAPPED. SaveParser and other code
+//   expecting a C string need a copy, e.g. view.str()
+// - the archive must not be truncated or rewritten in place while mapped,
+//   touching the view would raise SIGBUS. Drop views and call
+//   ZF_ClearCached before writing an archive that may be open
+struct ZFView {
+    const char*                 data   = NULL;
+    size_t                      size   = 0;
+    bool                        mapped = false; // data points into the archive mapping
+    std::shared_ptr<const void> owner;
+
+    explicit operator bool() const { return data != NULL; }
+    string str() const { return string(data, size); }
+};
+
+ZFView ZF_ViewZipFile(const char* path, string *buf);
+
 // read file with no decompression
 string ZF_LoadFileRaw(const char *path);
 
-// close any cached zip files
+// like ZF_LoadFile, but shares the buffer with the load cache. NULL if not found
+std::shared_ptr<const string> ZF_LoadFileShared(const char* path);
+
+// close any cached zip files and empty the load cache
 void ZF_ClearCached();
 
+// ZF_LoadFile keeps up to kLoadCacheMaxBytes of recently loaded files,
+// keyed on path plus the modification time and size of the file they came
+// from. 0 (the default) disables the cache.
+struct ZFCacheStats {
+    uint64 hits    = 0;
+    uint64 misses  = 0;
+    uint64 bytes   = 0;
+    uint64 entries = 0;
+
+    double hitRatio() const { return (hits + misses) ? (double) hits / (hits + misses) : 0.0; }
+};
+
+ZFCacheStats ZF_GetCacheStats();
+string ZF_CacheReport();
+
 // write gzip compressed file
 bool ZF_SaveFile(const char* path, const char* data, size_t size);
 inline bool ZF_SaveFile(const char* path, const string &data) { return ZF_SaveFile(path, &data[0], data.size()); }
@@ -25,17 +66,139 @@ inline bool ZF_SaveFile(const char* path, const string &data) { return ZF_SaveFi
 bool ZF_SaveFileRaw(const char* path, const char* data, size_t size);
 inline bool ZF_SaveFileRaw(const char* path, const string &data) { return ZF_SaveFileRaw(path, &data[0], data.size()); }
 
+// compression codecs. gzip is always available, the others when built with
+// ZF_HAS_LZ4 / ZF_HAS_ZSTD. Compressed data is identified by its magic bytes,
+// so ZF_Decompress reads any available codec. ZF_LoadFile looks for each
+// codec's extension (foo.gz, foo.lz4, foo.zst) and returns files without one
+// as is, even if they happen to start with a magic number.
+#ifndef ZF_HAS_LZ4
+#define ZF_HAS_LZ4 0
+#endif
+#ifndef ZF_HAS_ZSTD
+#define ZF_HAS_ZSTD 0
+#endif
+
+enum ZFCodec { ZF_GZIP, ZF_LZ4, ZF_ZSTD, ZF_CODEC_COUNT };
+
+bool ZF_CodecAvailable(ZFCodec codec);
+const char* ZF_CodecName(ZFCodec codec);
+// file extension for compressed files, e.g. ".gz"
+const char* ZF_CodecExtension(ZFCodec codec);
+// return codec that compressed data/size, or -1
+int ZF_DetectCodec(const char* data, size_t size);
+
 // compress data/size into gzip format
 string ZF_Compress(const char* data, size_t size);
 inline string ZF_Compress(const string &s) { return ZF_Compress(&s[0], s.size()); }
 
-// decompress data/size in gzip format
+// compress data/size with CODEC (gzip if unavailable)
+string ZF_Compress(const char* data, size_t size, ZFCodec codec);
+inline string ZF_Compress(const string &s, ZFCodec codec) { return ZF_Compress(&s[0], s.size(), codec); }
+
+// write PATH + ZF_CodecExtension(codec) compressed with CODEC. On success, removes
+// PATH in the other codecs. Fails without writing anything if compression fails
+bool ZF_SaveFile(const char* path, const char* data, size_t size, ZFCodec codec);
+
+// decompress data/size in any available format
 string ZF_Decompress(const char* data, size_t size);
 inline string ZF_Decompress(const string &s) { return ZF_Decompress(&s[0], s.size()); }
 
+// streaming gzip interface. Not subject to kFileSizeMax, memory use is bounded
+// by the chunk size. Callbacks return false to stop early.
+typedef std::function<bool(const char* data, size_t size)> ZFChunkFunc;
+
+// read a gzip compressed or uncompressed file in chunks. Unlike ZF_LoadFile,
+// does not look inside zip archives (use ZF_ViewZipFile for those)
+bool ZF_LoadFileChunked(const char* path, const ZFChunkFunc &func, size_t chunk=64 * 1024);
+
+// incrementally read a gzip compressed or uncompressed file
+struct ZFReader {
+    ZFReader() {}
+    ZFReader(const char* path) { open(path); }
+    ~ZFReader() { close(); }
+    ZFReader(const ZFReader&) = delete;
+    ZFReader& operator=(const ZFReader&) = delete;
+
+    bool open(const char* path);
+    // return bytes read, 0 at end of file, -1 on error
+    int read(char* buf, size_t size);
+    bool readLine(string *line);
+    bool isOpen() const { return m_gzf != NULL; }
+    void close();
+
+private:
+    struct gzFile_s *m_gzf = NULL;
+    string           m_path;
+};
+
+// incrementally write a gzip compressed file
+struct ZFWriter {
+    ZFWriter() {}
+    ZFWriter(const char* path) { open(path); }
+    ~ZFWriter() { close(); }
+    ZFWriter(const ZFWriter&) = delete;
+    ZFWriter& operator=(const ZFWriter&) = delete;
+
+    bool open(const char* path);
+    bool write(const char* data, size_t size);
+    bool write(const string &s) { return write(s.data(), s.size()); }
+    bool isOpen() const { return m_gzf != NULL; }
+    // flush and close, return false if any write failed
+    bool close();
+
+private:
+    struct gzFile_s *m_gzf = NULL;
+    string           m_path;
+    bool             m_ok = true;
+};
+
+// in memory streaming versions of ZF_Compress and ZF_Decompress. Feed input
+// as it arrives, output is passed to the callback as each chunk fills.
+struct ZFInflater {
+    ZFInflater(const ZFChunkFunc &out, size_t chunk=64 * 1024);
+    ~ZFInflater();
+    ZFInflater(const ZFInflater&) = delete;
+    ZFInflater& operator=(const ZFInflater&) = delete;
+
+    bool feed(const char* data, size_t size);
+    bool isDone() const { return m_done; }
+
+private:
+    struct z_stream_s *m_stream = NULL;
+    ZFChunkFunc        m_out;
+    string             m_buf;
+    bool               m_done = false;
+    bool               m_ok   = true;
+};
+
+struct ZFDeflater {
+    ZFDeflater(const ZFChunkFunc &out, size_t chunk=64 * 1024);
+    ~ZFDeflater();
+    ZFDeflater(const ZFDeflater&) = delete;
+    ZFDeflater& operator=(const ZFDeflater&) = delete;
+
+    bool feed(const char* data, size_t size);
+    bool feed(const string &s) { return feed(s.data(), s.size()); }
+    // flush remaining output and write the gzip trailer
+    bool finish();
+
+private:
+    bool deflate1(int flush);
+
+    struct z_stream_s *m_stream = NULL;
+    ZFChunkFunc        m_out;
+    string             m_buf;
+    bool               m_ok = true;
+};
+
 // load an entire directory or zip file into memory
 typedef std::pair<std::string, std::string> ZFFileData;
 typedef std::map<std::string, std::string> ZFDirMap;
 ZFDirMap ZF_LoadDirectory(const char* path, float* progress);
 
+// same as ZF_LoadDirectory, but reads and decompresses files on up to THREADS
+// threads (0 for one per cpu, up to kLoadDirectoryThreads), using the calling
+// thread and the job system workers
+ZFDirMap ZF_LoadDirectoryParallel(const char* path, float* progress, int threads=0);
+
 #endif
@@ -0,0 +1,188 @@
+
+// BenchHost.cpp - minimal OS layer and game callbacks for the benchmarks
+//
+// Stands in for os/sdl and the game's OLG_ functions, so the benchmarks can
+// link the engine core without SDL, a window or a log file. Paths are used
+// as given, relative to the working directory. Engine messages go to stderr
+// so they don't mix with the result tables on stdout.
+
+#include "StdAfx.h"
+
+#include <ftw.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+static const std::chrono::steady_clock::time_point s_start = std::chrono::steady_clock::now();
+
+void Report(string str)
+{
+    if (str.empty() || str.back() != '\n')
+        str += '\n';
+    fputs(str.c_str(), stderr);
+}
+
+void OL_ReportMessage(const char *str)
+{
+    fputs(str, stderr);
+}
+
+int OL_IsLogOpen(void)
+{
+    return 1;                   // ReportEarly prints immediately
+}
+
+void OL_OpenLog(void)
+{
+}
+
+void OL_ScheduleUploadLog(const char* reason)
+{
+}
+
+double OL_GetCurrentTime(void)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - s_start).count();
+}
+
+int OL_GetCpuCount(void)
+{
+    return max(1, (int)std::thread::hardware_concurrency());
+}
+
+const char* OL_GetPlatformDateInfo(void)
+{
+    static string info;
+    struct utsname un;
+    const time_t now = time(NULL);
+    char date[64] = "";
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    info = (uname(&un) == 0) ? str_format("%s %s %s, %s", un.sysname, un.release, un.machine, date) : date;
+    return info.c_str();
+}
+
+void OL_ThreadBeginIteration(void)
+{
+}
+
+void OL_ThreadEndIteration(void)
+{
+}
+
+void OL_Terminate(const char* message)
+{
+    fprintf(stderr, "Terminated: %s\n", message);
+    std::_Exit(1);
+}
+
+const char *OL_PathForFile(const char *fname, const char *mode)
+{
+    return fname;
+}
+
+int OL_FileDirectoryPathExists(const char* fname)
+{
+    struct stat buf;
+    return stat(fname, &buf) == 0 && (S_ISREG(buf.st_mode) || S_ISDIR(buf.st_mode));
+}
+
+int OL_DirectoryExists(const char* path)
+{
+    struct stat buf;
+    return stat(path, &buf) == 0 && S_ISDIR(buf.st_mode);
+}
+
+int OL_CreateParentDirs(const char* fname)
+{
+    const string dir = str_dirname(fname);
+    for (size_t i=1; i<=dir.size(); i++)
+    {
+        if (i < dir.size() && dir[i] != '/')
+            continue;
+        const string sub = dir.substr(0, i);
+        if (mkdir(sub.c_str(), 0755) && errno != EEXIST) {
+            Reportf("mkdir('%s'): %s", sub.c_str(), strerror(errno));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    return remove(fpath);
+}
+
+int OL_RemoveFileOrDirectory(const char* dirname)
+{
+    return nftw(dirname, unlink_cb, 64, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+int OL_RemoveFile(const char* fname)
+{
+    return remove(fname) == 0;
+}
+
+std::vector<std::string> OL_ListDirectoryFiles(const char* path)
+{
+    std::vector<std::string> files;
+    DIR *dir = opendir(path);
+    if (!dir)
+        return files;
+    while (dirent *entry = readdir(dir))
+    {
+        if (entry->d_name[0] != '.')
+            files.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+int OLG_vOnAssertFailed(const char* file, int line, const char* func,
+                        const char* x, const char* format, va_list v)
+{
+    fprintf(stderr, "%s:%d: %s: ASSERT(%s) failed: %s\n", file, line, func, x,
+            format ? str_vformat(format, v).c_str() : "");
+    return 1;
+}
+
+int OLG_OnAssertFailed(const char* file, int line, const char* func,
+                       const char* x, const char* format, ...)
+{
+    va_list v;
+    va_start(v, format);
+    OLG_vOnAssertFailed(file, line, func, x, format, v);
+    va_end(v);
+    return 1;
+}
+
+int OLG_OnTerminate(const char* message)
+{
+    return 1;
+}
+
+int OLG_EnableCrashHandler(void)
+{
+    return 0;
+}
+
+const char* OLG_GetName(void)
+{
+    return "OutlawsBench";
+}
+
+const char* OLG_GetLanguage(void)
+{
+    return "en";
+}
+
+int OLG_UseDevSavePath(void)
+{
+    return 1;                   // keeps Steam cloud out of SaveFile / LoadFile
+}
+
+void OLG_SetFullscreenPref(int enabled)
+{
+}
@@ -0,0 +1,33 @@
+
+//
+// BenchUtil.h - timing helpers shared by the benchmarks in this directory
+//
+
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#include <chrono>
+
+typedef std::chrono::steady_clock BenchClock;
+
+inline double elapsedSince(BenchClock::time_point start)
+{
+    return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+// run fun repeatedly for at least min_time seconds, return seconds per call
+template <typename F>
+double timeIt(double min_time, const F& fun)
+{
+    fun();                      // warm up
+    int iters = 0;
+    const BenchClock::time_point start = BenchClock::now();
+    double elapsed = 0.0;
+    do {
+        fun();
+        iters++;
+    } while ((elapsed = elapsedSince(start)) < min_time);
+    return elapsed / iters;
+}
+
+#endif
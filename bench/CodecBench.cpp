@@ -0,0 +1,104 @@
+
+// CodecBench.cpp - compare ZipFile compression codecs on real files
+//
+// For every codec compiled in (see ZF_HAS_LZ4 / ZF_HAS_ZSTD), compresses and
+// decompresses each input file and reports ratio and MB/s. Results are
+// printed as a table and written as JSON for regression tracking.
+//
+// usage: CodecBench output.json file...
+// build: see CMakeLists.txt in this directory
+//
+// MB/s is always measured against the uncompressed size.
+
+#include "StdAfx.h"
+#include "Save.h"
+#include "SaveJson.h"
+#include "ZipFile.h"
+
+#include "BenchUtil.h"
+
+#define SERIAL_CODEC_RESULT_FIELDS(F)                           \
+    F(string,               file,           string())           \
+    F(string,               codec,          string())           \
+    F(uint64,               bytes,          0)                  \
+    F(uint64,               compressed,     0)                  \
+    F(double,               ratio,          0.0)                \
+    F(double,               compress_mbps,  0.0)                \
+    F(double,               decompress_mbps, 0.0)               \
+    F(bool,                 roundtrip,      false)              \
+
+DECLARE_DEFINE_SERIAL_STRUCT(CodecResult, SERIAL_CODEC_RESULT_FIELDS);
+
+#define SERIAL_CODEC_REPORT_FIELDS(F)                           \
+    F(string,                   version,    string())           \
+    F(double,                   min_time,   0.0)                \
+    F(std::vector<CodecResult>, results,    std::vector<CodecResult>()) \
+
+DECLARE_DEFINE_SERIAL_STRUCT(CodecReport, SERIAL_CODEC_REPORT_FIELDS);
+
+int main(int argc, const char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s output.json file...\n", argv[0]);
+        return 1;
+    }
+
+    CodecReport report;
+    report.version = "1";
+    report.min_time = 0.5;
+
+    printf("%-32s %-6s %10s %10s %7s %10s %10s\n",
+           "file", "codec", "bytes", "compressed", "ratio", "comp MB/s", "decomp MB/s");
+    for (int i=2; i<argc; i++)
+    {
+        // already compressed saves are benchmarked on their contents
+        const string data = ZF_LoadFile(argv[i]);
+        if (data.empty()) {
+            fprintf(stderr, "failed to load '%s'\n", argv[i]);
+            continue;
+        }
+        const double mb = data.size() / (1024.0 * 1024.0);
+
+        for (int c=0; c<ZF_CODEC_COUNT; c++)
+        {
+            const ZFCodec codec = (ZFCodec)c;
+            if (!ZF_CodecAvailable(codec))
+                continue;
+
+            CodecResult res;
+            res.file = argv[i];
+            res.codec = ZF_CodecName(codec);
+            res.bytes = data.size();
+
+            string comp;
+            const double ctime = timeIt(report.min_time, [&]() { comp = ZF_Compress(data, codec); });
+            string decomp;
+            const double dtime = timeIt(report.min_time, [&]() { decomp = ZF_Decompress(comp); });
+
+            res.compressed = comp.size();
+            res.ratio = comp.size() ? (double) data.size() / comp.size() : 0.0;
+            res.compress_mbps = mb / ctime;
+            res.decompress_mbps = mb / dtime;
+            res.roundtrip = (decomp == data);
+
+            printf("%-32s %-6s %10llu %10llu %7.2f %10.1f %10.1f%s\n",
+                   str_basename(res.file).c_str(), res.codec.c_str(),
+                   (unsigned long long) res.bytes, (unsigned long long) res.compressed,
+                   res.ratio, res.compress_mbps, res.decompress_mbps,
+                   res.roundtrip ? "" : " MISMATCH");
+            fflush(stdout);
+            report.results.push_back(std::move(res));
+        }
+    }
+
+    if (!serializeToJsonFile(argv[1], report)) {
+        fprintf(stderr, "failed to write '%s'\n", argv[1]);
+        return 1;
+    }
+
+    for (const CodecResult &res : report.results) {
+        if (!res.roundtrip)
+            return 2;
+    }
+    return 0;
+}
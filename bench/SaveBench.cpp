@@ -0,0 +1,291 @@
+
+// SaveBench.cpp - SaveSerializer / SaveParser throughput benchmark
+//
+// Builds synthetic reflected data of a few different shapes, then times
+// serialize and parse in each output mode. Results are printed as a table
+// and written as JSON for regression tracking. If nlohmann/json is on the
+// include path, the same JSON text is also parsed and dumped with it as a
+// reference point for the JsonParser / JsonSerializer numbers.
+//
+// usage: SaveBench [output.json] [min seconds per measurement]
+// build: see CMakeLists.txt in this directory
+
+#include "StdAfx.h"
+#include "Save.h"
+#include "SaveJson.h"
+#include "ZipFile.h"
+
+#include "BenchUtil.h"
+
+#ifndef BENCH_NLOHMANN
+#if defined(__has_include)
+#if __has_include(<nlohmann/json.hpp>)
+#define BENCH_NLOHMANN 1
+#endif
+#endif
+#endif
+
+#if BENCH_NLOHMANN
+#include <nlohmann/json.hpp>
+#endif
+
+#define BENCH_FLAGS(F)                          \
+    F(VISIBLE,  1<<0)                           \
+    F(SOLID,    1<<1)                           \
+    F(DYNAMIC,  1<<2)                           \
+    F(SELECTED, 1<<3)                           \
+    F(DAMAGED,  1<<4)                           \
+
+DEFINE_ENUM(uchar, EBenchFlags, BENCH_FLAGS);
+
+#define BENCH_SHAPES(F)                         \
+    F(SQUARE,   0)                              \
+    F(OCTAGON,  1)                              \
+    F(TRIANGLE, 2)                              \
+    F(RHOMBUS,  3)                              \
+
+DEFINE_ENUM(uchar, EBenchShape, BENCH_SHAPES);
+
+// big vectors of small structs
+#define SERIAL_BENCH_LEAF_FIELDS(F)                             \
+    F(uint,                 ident,          0)                  \
+    F(float2,               offset,         float2(0.f))        \
+    F(float,                angle,          0.f)                \
+    F(EBenchShape,          shape,          EBenchShape::SQUARE) \
+    F(EBenchFlags,          flags,          EBenchFlags())      \
+
+DECLARE_DEFINE_SERIAL_STRUCT(BenchLeaf, SERIAL_BENCH_LEAF_FIELDS);
+
+// deep nesting
+#define SERIAL_BENCH_NODE_FIELDS(F)                             \
+    F(lstring,              name,           lstring())          \
+    F(int,                  depth,          0)                  \
+    F(std::vector<uint>,    refs,           std::vector<uint>()) \
+    F(std::vector<BenchNode>, children,     std::vector<BenchNode>()) \
+
+DECLARE_DEFINE_SERIAL_STRUCT(BenchNode, SERIAL_BENCH_NODE_FIELDS);
+
+// strings and enums
+#define SERIAL_BENCH_RECORD_FIELDS(F)                           \
+    F(string,               title,          string())           \
+    F(string,               description,    string())           \
+    F(EBenchShape,          shape,          EBenchShape::SQUARE) \
+    F(EBenchFlags,          flags,          EBenchFlags())      \
+    F(double,               timestamp,      0.0)                \
+
+DECLARE_DEFINE_SERIAL_STRUCT(BenchRecord, SERIAL_BENCH_RECORD_FIELDS);
+
+#define SERIAL_BENCH_RESULT_FIELDS(F)                           \
+    F(string,               shape,          string())           \
+    F(string,               mode,           string())           \
+    F(uint64,               bytes,          0)                  \
+    F(double,               serialize_mbps, 0.0)                \
+    F(double,               parse_mbps,     0.0)                \
+    F(bool,                 roundtrip,      false)              \
+
+DECLARE_DEFINE_SERIAL_STRUCT(BenchResult, SERIAL_BENCH_RESULT_FIELDS);
+
+#define SERIAL_BENCH_REPORT_FIELDS(F)                           \
+    F(string,                   version,    string())           \
+    F(double,                   min_time,   0.0)                \
+    F(std::vector<BenchResult>, results,    std::vector<BenchResult>()) \
+
+DECLARE_DEFINE_SERIAL_STRUCT(BenchReport, SERIAL_BENCH_REPORT_FIELDS);
+
+
+static const char* kWords[] = {
+    "agent", "block", "cluster", "drone", "engine", "fleet", "gun", "hull",
+    "ion", "jump", "kinetic", "laser", "missile", "node", "orbit", "plasma",
+};
+
+static string randomWords(std::mt19937 &rng, int count)
+{
+    string s;
+    for (int i=0; i<count; i++) {
+        if (i)
+            s += ' ';
+        s += kWords[rng() % arraySize(kWords)];
+    }
+    // exercise string escaping
+    if (rng() % 8 == 0)
+        s += "\n\"quoted\"\t";
+    return s;
+}
+
+// text modes write floats with 3 decimal places, quantize so data round trips
+static float quantize(float f)
+{
+    return std::round(f * 1000.f) / 1000.f;
+}
+
+static std::vector<BenchLeaf> makeLeaves(std::mt19937 &rng, int count)
+{
+    std::uniform_real_distribution<float> pos(-1000.f, 1000.f);
+    std::uniform_real_distribution<float> ang(0.f, M_TAUf);
+    std::vector<BenchLeaf> leaves(count);
+    for (int i=0; i<count; i++)
+    {
+        BenchLeaf &lf = leaves[i];
+        lf.ident  = i + 1;
+        lf.offset = float2(quantize(pos(rng)), quantize(pos(rng)));
+        lf.angle  = quantize(ang(rng));
+        lf.shape  = EBenchShape(rng() % 4);
+        lf.flags  = EBenchFlags(rng() % 32);
+    }
+    return leaves;
+}
+
+static void makeTree(std::mt19937 &rng, BenchNode &node, int depth, int fanout)
+{
+    node.depth = depth;
+    node.name = lstring(kWords[rng() % arraySize(kWords)]);
+    for (int i=0; i<3; i++)
+        node.refs.push_back(rng() % 1000);
+    if (depth == 0)
+        return;
+    node.children.resize(fanout);
+    for (BenchNode &child : node.children)
+        makeTree(rng, child, depth - 1, fanout);
+}
+
+static std::vector<BenchRecord> makeRecords(std::mt19937 &rng, int count)
+{
+    std::vector<BenchRecord> records(count);
+    for (int i=0; i<count; i++)
+    {
+        BenchRecord &rc = records[i];
+        rc.title       = randomWords(rng, 2);
+        rc.description = randomWords(rng, 12);
+        rc.shape       = EBenchShape(rng() % 4);
+        rc.flags       = EBenchFlags(rng() % 32);
+        rc.timestamp   = 1e6 + i * 0.25;
+    }
+    return records;
+}
+
+enum BenchMode { MODE_TEXT, MODE_COMPACT, MODE_BINARY, MODE_GZIP, MODE_JSON, MODE_COUNT };
+static const char* kModeNames[] = { "text", "compact", "binary", "gzip", "json" };
+
+template <typename T>
+static string benchWrite(BenchMode mode, const T& data)
+{
+    switch (mode)
+    {
+    case MODE_TEXT:    return SaveSerializer::toString(data);
+    case MODE_COMPACT: return SaveSerializer::toString(data, SaveSerializer::COMPACT);
+    case MODE_BINARY:  return SaveSerializer::toString(data, SaveSerializer::BINARY|SaveSerializer::COMPACT);
+    case MODE_GZIP:    return ZF_Compress(SaveSerializer::toString(data, SaveSerializer::COMPACT));
+    case MODE_JSON:    return JsonSerializer::toString(data);
+    default:           return string();
+    }
+}
+
+template <typename T>
+static bool benchRead(BenchMode mode, const string &buf, T* data)
+{
+    switch (mode)
+    {
+    case MODE_GZIP: return SaveParser::parse(ZF_Decompress(buf), data);
+    case MODE_JSON: return JsonParser::parse(buf, data);
+    default:        return SaveParser::parse(buf, data);
+    }
+}
+
+static void printResult(const BenchResult &res)
+{
+    printf("%-8s %-8s %10llu %10.1f %10.1f %s\n", res.shape.c_str(), res.mode.c_str(),
+           (unsigned long long) res.bytes, res.serialize_mbps, res.parse_mbps,
+           res.roundtrip ? "OK" : "MISMATCH");
+    fflush(stdout);
+}
+
+#if BENCH_NLOHMANN
+// parse and dump the JsonSerializer output with nlohmann::json, for comparison
+// with the json mode. Dumping starts from an already built document
+static void benchNlohmann(BenchReport &report, const char* shape, const string &buf)
+{
+    BenchResult res;
+    res.shape = shape;
+    res.mode = "nlohmann";
+
+    const nlohmann::json doc = nlohmann::json::parse(buf, nullptr, false);
+    string out;
+    const double wtime = timeIt(report.min_time, [&]() { out = doc.dump(); });
+    const double rtime = timeIt(report.min_time, [&]() {
+            nlohmann::json val = nlohmann::json::parse(buf, nullptr, false);
+        });
+
+    res.roundtrip = !doc.is_discarded() && nlohmann::json::parse(out, nullptr, false) == doc;
+    res.bytes = buf.size();
+    res.serialize_mbps = (buf.size() / (1024.0 * 1024.0)) / wtime;
+    res.parse_mbps = (buf.size() / (1024.0 * 1024.0)) / rtime;
+    printResult(res);
+    report.results.push_back(std::move(res));
+}
+#endif
+
+template <typename T>
+static void benchShape(BenchReport &report, const char* shape, const T& data)
+{
+    for (int m=0; m<MODE_COUNT; m++)
+    {
+        const BenchMode mode = (BenchMode)m;
+        BenchResult res;
+        res.shape = shape;
+        res.mode = kModeNames[mode];
+
+        string buf;
+        const double wtime = timeIt(report.min_time, [&]() { buf = benchWrite(mode, data); });
+
+        T parsed;
+        res.roundtrip = benchRead(mode, buf, &parsed) && parsed == data;
+        const double rtime = timeIt(report.min_time, [&]() {
+                T val;
+                benchRead(mode, buf, &val);
+            });
+
+        // bytes is the size written, but throughput is measured against the
+        // uncompressed text, so gzip MB/s compares directly with compact
+        const size_t raw = (mode == MODE_GZIP) ? ZF_Decompress(buf).size() : buf.size();
+        res.bytes = buf.size();
+        res.serialize_mbps = (raw / (1024.0 * 1024.0)) / wtime;
+        res.parse_mbps = (raw / (1024.0 * 1024.0)) / rtime;
+
+        printResult(res);
+        report.results.push_back(std::move(res));
+    }
+#if BENCH_NLOHMANN
+    benchNlohmann(report, shape, JsonSerializer::toString(data));
+#endif
+}
+
+int main(int argc, const char** argv)
+{
+    const char* output = (argc > 1) ? argv[1] : "save_bench.json";
+    BenchReport report;
+    report.version = "1";
+    report.min_time = (argc > 2) ? atof(argv[2]) : 0.5;
+
+    std::mt19937 rng(1234);
+    const std::vector<BenchLeaf> leaves = makeLeaves(rng, 50000);
+    BenchNode tree;
+    makeTree(rng, tree, 8, 3);
+    const std::vector<BenchRecord> records = makeRecords(rng, 10000);
+
+    printf("%-8s %-8s %10s %10s %10s\n", "shape", "mode", "bytes", "write MB/s", "read MB/s");
+    benchShape(report, "leaves", leaves);
+    benchShape(report, "tree", tree);
+    benchShape(report, "records", records);
+
+    if (!serializeToJsonFile(output, report)) {
+        fprintf(stderr, "failed to write '%s'\n", output);
+        return 1;
+    }
+    printf("wrote %s\n", output);
+
+    for (const BenchResult &res : report.results) {
+        if (!res.roundtrip)
+            return 2;
+    }
+    return 0;
+}
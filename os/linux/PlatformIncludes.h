@@ -25,6 +25,13 @@
 
 #define HAS_SOUND 1
 
+// io_uring backend for AsyncIO raw reads and writes. Needs liburing: build
+// with -DOL_HAS_IO_URING=1 and link -luring. Off by default, the thread pool
+// is used instead
+#ifndef OL_HAS_IO_URING
+#define OL_HAS_IO_URING 0
+#endif
+
 // use nanosleep in gcc 4.8
 #ifndef _GLIBCXX_USE_NANOSLEEP
 #define _GLIBCXX_USE_NANOSLEEP 1
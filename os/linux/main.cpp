@@ -13,6 +13,7 @@
 #include <dlfcn.h>
 #include <link.h>
 #include <execinfo.h>
+#include <sys/inotify.h>
 
 #include "../sdl_os/posix.h"
 #include <X11/Xlib.h>
@@ -228,22 +229,109 @@ static std::set<std::string> listDirectory(const char* path1, const char *flags)
     return files;
 }
 
-const char** OL_ListDirectory(const char* path)
-{
-    // not thread safe!!
-    static vector<const char*> elements;
+// directory listings, invalidated by inotify events
+struct DirListCache {
+    std::mutex                                                  mutex;
+    int                                                         fd = -1;
+    std::unordered_map<std::string, std::vector<std::string>>   listings;
+    std::unordered_map<int, std::vector<std::string>>           watchers; // watch descriptor -> listings
+
+    static DirListCache &instance()
+    {
+        static DirListCache *dc = new DirListCache;
+        return *dc;
+    }
+
+    DirListCache()
+    {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0)
+            ReportLinux("inotify_init1 failed, directory listings are not cached: %s", strerror(errno));
+    }
+
+    // mutex held
+    void drainEvents()
+    {
+        char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = 0;
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+        {
+            for (char *ptr = buf; ptr < buf + len; )
+            {
+                const inotify_event *ev = (const inotify_event *) ptr;
+                ptr += sizeof(inotify_event) + ev->len;
+
+                auto it = watchers.find(ev->wd);
+                if (it == watchers.end())
+                    continue;
+                for (const std::string &path : it->second)
+                    listings.erase(path);
+                watchers.erase(it);
+                if (!(ev->mask&IN_IGNORED))
+                    inotify_rm_watch(fd, ev->wd);
+            }
+        }
+    }
+
+    // watch the directory, or its parent for the directory being created
+    bool watch(const char* path1, const char *flags)
+    {
+        const uint mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+        string dir = OL_PathForFile(path1, flags);
+        int wd = inotify_add_watch(fd, dir.c_str(), mask | IN_ONLYDIR);
+        if (wd < 0 && errno == ENOENT)
+            wd = inotify_add_watch(fd, str_dirname(dir).c_str(), mask | IN_ONLYDIR);
+        if (wd < 0)
+            return false;
+        vec_add(watchers[wd], string(path1));
+        return true;
+    }
+
+    std::vector<std::string> list(const char* path)
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        if (fd >= 0)
+        {
+            drainEvents();
+            auto it = listings.find(path);
+            if (it != listings.end())
+                return it->second;
+        }
+
+        // watch before listing so changes made while listing invalidate it
+        const bool cache = fd >= 0 && watch(path, "p") && watch(path, "w");
+
+        std::set<std::string> files = listDirectory(path, "p");
+        std::set<std::string> local = listDirectory(path, "w");
+        files.insert(local.begin(), local.end());
 
-    std::set<std::string> files = listDirectory(path, "p");
-    std::set<std::string> local = listDirectory(path, "w");
+        std::vector<std::string> result(files.begin(), files.end());
+        if (cache)
+            listings[path] = result;
+        return result;
+    }
+};
+
+std::vector<std::string> OL_ListDirectoryFiles(const char* path)
+{
+    return DirListCache::instance().list(path);
+}
 
-    foreach (const std::string &file, local)
-        files.insert(file);
+const char** OL_ListDirectory(const char* path)
+{
+    static THREAD_LOCAL vector<string> *names = NULL;
+    static THREAD_LOCAL vector<const char*> *elements = NULL;
+    if (!names) {
+        names = new vector<string>;
+        elements = new vector<const char*>;
+    }
 
-    elements.clear();
-    foreach (const std::string &file, files)
-        elements.push_back(lstring(file).c_str());
-    elements.push_back(NULL);
-    return &elements[0];
+    *names = OL_ListDirectoryFiles(path);
+    elements->clear();
+    foreach (const std::string &file, *names)
+        elements->push_back(file.c_str());
+    elements->push_back(NULL);
+    return &(*elements)[0];
 }
 
 string os_get_platform_info()
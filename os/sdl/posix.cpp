@@ -304,6 +304,30 @@ void posix_set_signal_handler()
     }
 }
 
+#if __APPLE__
+
+// linux and windows versions are in the per-os file
+std::vector<std::string> OL_ListDirectoryFiles(const char* path1)
+{
+    std::set<std::string> files;
+    for (const char* flags : { "p", "w" })
+    {
+        DIR *dir = opendir(OL_PathForFile(path1, flags));
+        if (!dir)
+            continue;
+        dirent *entry = NULL;
+        while ((entry = readdir(dir)))
+        {
+            if (entry->d_name[0] != '.')
+                files.insert(entry->d_name);
+        }
+        closedir(dir);
+    }
+    return std::vector<std::string>(files.begin(), files.end());
+}
+
+#endif
+
 void OL_Terminate(const char* message)
 {
     if (!OLG_EnableCrashHandler())
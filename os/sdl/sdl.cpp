@@ -495,11 +495,11 @@ int OL_SaveImage(const OutlawImage *img, const char* fname)
 
 static lstring                             g_fontFiles[OL_MAX_FONTS];
 static std::unordered_map<uint, TTF_Font*> g_fonts;
-static std::mutex                          g_fontMutex;
+static profiled_mutex                      g_fontMutex("fonts");
 
 TTF_Font* getFont(int index, float size)
 {
-    std::lock_guard<std::mutex> l(g_fontMutex);
+    std::lock_guard<profiled_mutex> l(g_fontMutex);
     if (0 > index || index > OL_MAX_FONTS)
         return NULL;
 
@@ -530,7 +530,7 @@ void OL_SetFont(int index, const char* file)
     const char* fname = OL_PathForFile(file, "r");
     if (fname && OL_FileDirectoryPathExists(fname))
     {
-        std::lock_guard<std::mutex> l(g_fontMutex);
+        std::lock_guard<profiled_mutex> l(g_fontMutex);
         g_fontFiles[index] = lstring(fname);
         for (auto it = g_fonts.begin(); it != g_fonts.end(); )
         {
@@ -1116,6 +1116,7 @@ const char* sdl_os_autorelease(std::string &val)
 void OL_ThreadEndIteration()
 {
     AutoreleasePool::instance().drain();
+    frame_arena_reset();
 }
 
 void OL_WarpCursorPosition(float x, float y)
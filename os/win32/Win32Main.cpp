@@ -368,7 +368,7 @@ static std::set<std::wstring> listDirectory(const char *path1, const char *mode)
     return files;
 }
 
-const char** OL_ListDirectory(const char* path1)
+std::vector<std::string> OL_ListDirectoryFiles(const char* path1)
 {
     std::set<std::wstring> files = listDirectory(path1, "p");
 
@@ -382,17 +382,30 @@ const char** OL_ListDirectory(const char* path1)
     }
 
     // ReportWin32("Listing '%s': %d files (%d local)", path1, (int)files.size(), local_count);
-    if (files.empty())
+    std::vector<std::string> result;
+    foreach (const std::wstring &file, files)
+        result.push_back(ws2s(file));
+    return result;
+}
+
+const char** OL_ListDirectory(const char* path1)
+{
+    static THREAD_LOCAL vector<string> *names = NULL;
+    static THREAD_LOCAL vector<const char*> *elements = NULL;
+    if (!names) {
+        names = new vector<string>;
+        elements = new vector<const char*>;
+    }
+
+    *names = OL_ListDirectoryFiles(path1);
+    if (names->empty())
         return NULL;
 
-    // not thread safe!!
-    static vector<const char*> elements;
-    elements.clear();
-    foreach (const std::wstring &file, files)
-        elements.push_back(lstring(ws2s(file)).c_str());
-    elements.push_back(NULL);
-    
-    return &elements[0];
+    elements->clear();
+    foreach (const std::string &file, *names)
+        elements->push_back(file.c_str());
+    elements->push_back(NULL);
+    return &(*elements)[0];
 }
 
 bool os_symlink_f(const char* source, const char* dest)
@@ -2,6 +2,16 @@
 #include "StdAfx.h"
 #include "stl_ext.h"
 
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <limits>
+#include <list>
+
+#if __linux__
+#include <sys/mman.h>
+#endif
+
 dummy_ref_t the_dummy_ref = dummy_ref_t();
 
 int findLeadingOne(uint v, int i)
@@ -57,6 +67,239 @@ void Watchable::nullReferencesTo()
             watcher->prev->next = NULL;
         watcher->prev = NULL;
     }
+
+    std::lock_guard<std::recursive_mutex> l(watch_stripe(this));
+    sync_watch_base *watcher = sync_watch_list;
+    sync_watch_list = NULL;
+    while (watcher)
+    {
+        sync_watch_base *next = watcher->next;
+        watcher->next = NULL;
+        watcher->prev = NULL;
+        // last: once ptr is NULL the owner may unlink without the lock and free it
+        watcher->ptr.store(NULL);
+        watcher = next;
+    }
+}
+
+std::recursive_mutex &watch_stripe(const void *p)
+{
+    static std::recursive_mutex *stripes = new std::recursive_mutex[64];
+    const uintptr_t v = (uintptr_t) p;
+    return stripes[((v >> 4) ^ (v >> 10)) % 64];
+}
+
+void sync_watch_base::unlink()
+{
+    for (;;)
+    {
+        const Watchable *p = ptr.load();
+        if (!p)
+            return;             // nullReferencesTo already unlinked us
+        std::lock_guard<std::recursive_mutex> l(watch_stripe(p));
+        if (ptr.load() != p)
+            continue;
+        if (prev)
+            prev->next = next;
+        else
+            p->sync_watch_list = next;
+        if (next)
+            next->prev = prev;
+        next = NULL;
+        prev = NULL;
+        ptr.store(NULL);
+        return;
+    }
+}
+
+void sync_watch_base::link(const Watchable* p)
+{
+    ASSERT(ptr.load() == NULL);
+    if (!p)
+        return;
+    std::lock_guard<std::recursive_mutex> l(watch_stripe(p));
+    prev = NULL;
+    next = p->sync_watch_list;
+    if (next)
+        next->prev = this;
+    p->sync_watch_list = this;
+    ptr.store(p);
+}
+
+void sync_watch_base::link(const sync_watch_base &o)
+{
+    ASSERT(ptr.load() == NULL);
+    for (;;)
+    {
+        const Watchable *p = o.ptr.load();
+        if (!p)
+            return;
+        std::lock_guard<std::recursive_mutex> l(watch_stripe(p));
+        if (o.ptr.load() != p)
+            continue;           // nulled while we waited
+        prev = NULL;
+        next = p->sync_watch_list;
+        if (next)
+            next->prev = this;
+        p->sync_watch_list = this;
+        ptr.store(p);
+        return;
+    }
+}
+
+struct WatchTest final : public Watchable {
+    enum { kMagic = 0x5a7c };
+    int magic = kMagic;
+    int value = 0;
+};
+
+bool watch_runtests()
+{
+#if IS_DEVEL
+    Report("Beginning Watch Tests");
+
+    // relinking, locking and deleting through a held stripe must not deadlock
+    WatchTest *obj = new WatchTest;
+    sync_watch_ptr<WatchTest> ptr(obj);
+    {
+        sync_watch_ptr<WatchTest>::Locked lk = ptr.lock();
+        ASSERT(lk && lk->magic == WatchTest::kMagic);
+        sync_watch_ptr<WatchTest> copy(ptr);
+        sync_watch_ptr<WatchTest>::Locked lk2 = copy.lock();
+        ASSERT(lk2.ptr == obj);
+        copy = nullptr;
+        obj->nullReferencesTo();
+        ASSERT(!ptr);
+    }
+    delete obj;
+
+    // one thread replaces and deletes pointees while others copy and lock them
+    enum { kSlots = 8, kReaders = 3, kIterations = 20000 };
+    sync_watch_ptr<WatchTest> slots[kSlots];
+    std::atomic<bool> done(false);
+    std::atomic<int> hits(0);
+    std::vector<std::thread> readers;
+    for (int t=0; t<kReaders; t++)
+    {
+        readers.emplace_back([&, t]() {
+                for (int i=t; !done.load(); i++)
+                {
+                    sync_watch_ptr<WatchTest> mine(slots[i % kSlots]);
+                    sync_watch_ptr<WatchTest>::Locked lk = mine.lock();
+                    if (!lk)
+                        continue;
+                    ASSERT(lk->magic == WatchTest::kMagic);
+                    sync_watch_ptr<WatchTest> inner(lk.ptr);
+                    ASSERT(inner.lock().ptr == lk.ptr);
+                    hits++;
+                }
+            });
+    }
+    for (int i=0; i<kIterations; i++)
+    {
+        WatchTest *next = new WatchTest;
+        next->value = i;
+        WatchTest *old = slots[i % kSlots].get();
+        slots[i % kSlots] = next;
+        if (old) {
+            old->nullReferencesTo();
+            old->magic = 0;
+            delete old;
+        }
+    }
+    done = true;
+    foreach (std::thread &th, readers)
+        th.join();
+    for (int i=0; i<kSlots; i++)
+    {
+        WatchTest *last = slots[i].get();
+        slots[i] = nullptr;
+        delete last;
+    }
+    Reportf("Watch stress: %d locked reads", hits.load());
+    Report("Ending Watch Tests");
+#endif
+    return true;
+}
+
+std::atomic<HandleTable::Slot*> HandleTable::s_pages[HandleTable::kMaxPages];
+
+// free slots and table size, only touched on allocate/release
+struct HandleTableState {
+    std::mutex        mutex;
+    std::vector<uint> freeSlots;
+    uint              slots = 0;
+
+    static HandleTableState &instance()
+    {
+        static HandleTableState *st = new HandleTableState;
+        return *st;
+    }
+};
+
+uint64 HandleTable::allocate(const Handleable *ptr)
+{
+    HandleTableState &st = HandleTableState::instance();
+    std::lock_guard<std::mutex> l(st.mutex);
+    uint idx;
+    if (st.freeSlots.size())
+    {
+        idx = st.freeSlots.back();
+        st.freeSlots.pop_back();
+    }
+    else
+    {
+        idx = st.slots++;
+        const uint page = idx >> kPageBits;
+        if (page >= kMaxPages) {
+            ASSERT_FAILED("HandleTable", "%d slots allocated! No handles available", idx);
+            OL_Terminate("Out of handles!");
+        }
+        if (!s_pages[page].load(std::memory_order_relaxed))
+            s_pages[page].store(new Slot[kPageSize](), std::memory_order_release);
+    }
+    Slot &slot = s_pages[idx >> kPageBits].load(std::memory_order_relaxed)[idx & (kPageSize - 1)];
+    slot.ptr.store(ptr, std::memory_order_release);
+    return ((uint64) (idx + 1) << 32) | slot.generation.load(std::memory_order_relaxed);
+}
+
+void HandleTable::release(uint64 handle)
+{
+    if (!handle)
+        return;
+    const uint idx = (uint) (handle >> 32) - 1;
+    Slot &slot = s_pages[idx >> kPageBits].load(std::memory_order_acquire)[idx & (kPageSize - 1)];
+    // null first, so a reader that sees the old generation also sees NULL or the old pointer
+    slot.ptr.store(NULL, std::memory_order_release);
+    slot.generation.fetch_add(1, std::memory_order_acq_rel);
+
+    HandleTableState &st = HandleTableState::instance();
+    std::lock_guard<std::mutex> l(st.mutex);
+    st.freeSlots.push_back(idx);
+}
+
+size_t HandleTable::getSlotCount()
+{
+    HandleTableState &st = HandleTableState::instance();
+    std::lock_guard<std::mutex> l(st.mutex);
+    return st.slots - st.freeSlots.size();
+}
+
+uint64 Handleable::getHandle() const
+{
+    uint64 handle = m_handle.load(std::memory_order_acquire);
+    if (handle)
+        return handle;
+    const uint64 mine = HandleTable::allocate(this);
+    if (m_handle.compare_exchange_strong(handle, mine))
+        return mine;
+    HandleTable::release(mine); // another thread got there first
+    return handle;
+}
+
+void Handleable::nullHandles()
+{
+    HandleTable::release(m_handle.exchange(0));
 }
 
 std::mutex& _thread_name_mutex()
@@ -168,9 +411,17 @@ void thread_setup(const char* name)
     Reportf("Thread %#llx is named '%s'", tid, name);
 }
 
+#if !TARGET_OS_IPHONE
+static THREAD_LOCAL FrameArena *s_frameArena = NULL; // see FrameArena::current
+#endif
+
 void thread_cleanup()
 {
     deleteNull(my_random_device());
+    MemoryPool::flushThreadCache();
+#if !TARGET_OS_IPHONE
+    deleteNull(s_frameArena);
+#endif
 
     std::lock_guard<std::mutex> l(_thread_name_mutex());
     _thread_name_map().erase(thread_getid());
@@ -181,7 +432,8 @@ const char* thread_current_name()
 {
     const uint64 tid = thread_getid();
     std::lock_guard<std::mutex> l(_thread_name_mutex());
-    return _thread_name_map()[tid];
+    auto it = _thread_name_map().find(tid);
+    return (it != _thread_name_map().end()) ? it->second : NULL;
 }
 
 
@@ -234,29 +486,769 @@ void thread_join(OL_Thread thread)
 #endif
 
 
+static DEFINE_CVAR(int, kJobThreads, 0);
+static DEFINE_CVAR(int, kVecParThreshold, 2048);
+
+struct JobState {
+    JobFunc             fun;
+    std::atomic<int>    pending;     // unfinished dependencies, +1 until submitted
+    bool                done = false; // guarded by mutex
+    std::mutex          mutex;
+    std::vector<JobRef> continuations;
+
+    JobState(JobFunc &&f) : fun(std::move(f)), pending(1) {}
+};
+
+// a worker's deque. The owner pushes and pops at the back, thieves take the front
+struct JobQueue {
+    std::mutex         mutex;
+    std::deque<JobRef> jobs;
+};
+
+#if !TARGET_OS_IPHONE
+static THREAD_LOCAL int s_jobWorker = -1;
+#endif
+
+struct JobSystem {
+    std::mutex              mutex;     // guards start/stop and sleeping
+    std::condition_variable wakeCond;  // workers wait for jobs
+    std::condition_variable doneCond;  // job_wait waits for completion
+    std::vector<JobQueue*>  queues;
+    std::vector<OL_Thread>  threads;
+    std::atomic<int>        queued;
+    std::atomic<int>        waiters;
+    std::atomic<uint>       nextQueue;
+    std::atomic<bool>       started;
+    bool                    quit = false;
+
+    JobSystem() : queued(0), waiters(0), nextQueue(0), started(false) {}
+
+    static JobSystem &instance()
+    {
+        static JobSystem *js = new JobSystem;
+        return *js;
+    }
+
+    static int currentWorker()
+    {
+#if TARGET_OS_IPHONE
+        return -1;              // no THREAD_LOCAL
+#else
+        return s_jobWorker;
+#endif
+    }
+
+    struct WorkerArg {
+        JobSystem *js;
+        int        index;
+    };
+
+    static void *workerMain(void *arg)
+    {
+        WorkerArg wa = *(WorkerArg*) arg;
+        delete (WorkerArg*) arg;
+        thread_setup("Job Worker");
+#if !TARGET_OS_IPHONE
+        s_jobWorker = wa.index;
+#endif
+        wa.js->workerLoop(wa.index);
+        thread_cleanup();
+        return NULL;
+    }
+
+    void start()
+    {
+        if (started)
+            return;
+        std::lock_guard<std::mutex> l(mutex);
+        if (started)
+            return;
+        quit = false;
+        const int count = (kJobThreads > 0) ? (int)kJobThreads : max(0, OL_GetCpuCount() - 1);
+        for (int i=0; i<count; i++)
+            queues.push_back(new JobQueue);
+        for (int i=0; i<count; i++)
+            threads.push_back(thread_create(workerMain, new WorkerArg{this, i}));
+        started = true;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            if (!started)
+                return;
+            quit = true;
+        }
+        wakeCond.notify_all();
+        foreach (OL_Thread th, threads)
+        {
+            thread_join(th);
+#if !OL_USE_PTHREADS
+            delete th;
+#endif
+        }
+        threads.clear();
+
+        // run anything left on this thread
+        while (runOne(-1));
+        vec_clear_deep(queues);
+        started = false;
+    }
+
+    void enqueue(JobRef &&job)
+    {
+        if (queues.empty())
+        {
+            // single threaded
+            run(job);
+            return;
+        }
+        int idx = currentWorker();
+        if (idx < 0)
+            idx = nextQueue++ % queues.size();
+        {
+            JobQueue &q = *queues[idx];
+            std::lock_guard<std::mutex> l(q.mutex);
+            q.jobs.push_back(std::move(job));
+        }
+        queued++;
+        {
+            // don't notify between a worker checking queued and sleeping
+            std::lock_guard<std::mutex> l(mutex);
+        }
+        wakeCond.notify_one();
+    }
+
+    JobRef pop(int self)
+    {
+        const int count = queues.size();
+        if (self >= 0)
+        {
+            JobQueue &q = *queues[self];
+            std::lock_guard<std::mutex> l(q.mutex);
+            if (q.jobs.size()) {
+                JobRef job = std::move(q.jobs.back());
+                q.jobs.pop_back();
+                return job;
+            }
+        }
+        for (int i=1; i<=count; i++)
+        {
+            JobQueue &q = *queues[(max(self, 0) + i) % count];
+            std::lock_guard<std::mutex> l(q.mutex);
+            if (q.jobs.size()) {
+                JobRef job = std::move(q.jobs.front());
+                q.jobs.pop_front();
+                return job;
+            }
+        }
+        return JobRef();
+    }
+
+    void run(const JobRef &job)
+    {
+        job->fun();
+        job->fun = NULL;        // free captures now
+
+        std::vector<JobRef> next;
+        {
+            std::lock_guard<std::mutex> l(job->mutex);
+            job->done = true;
+            next.swap(job->continuations);
+        }
+        foreach (JobRef &nx, next)
+        {
+            if (--nx->pending == 0)
+                enqueue(std::move(nx));
+        }
+        if (waiters)
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            doneCond.notify_all();
+        }
+    }
+
+    bool runOne(int self)
+    {
+        if (queued <= 0 || queues.empty())
+            return false;
+        JobRef job = pop(self);
+        if (!job)
+            return false;
+        queued--;
+        run(job);
+        return true;
+    }
+
+    void workerLoop(int self)
+    {
+        for (;;)
+        {
+            if (runOne(self))
+                continue;
+            OL_ThreadEndIteration();
+            std::unique_lock<std::mutex> l(mutex);
+            wakeCond.wait(l, [this]() { return quit || queued > 0; });
+            if (quit && queued <= 0)
+                break;
+        }
+    }
+
+    void wait(const JobRef &job)
+    {
+        const int self = currentWorker();
+        while (!job_done(job))
+        {
+            if (runOne(self))
+                continue;
+            waiters++;
+            {
+                std::unique_lock<std::mutex> l(mutex);
+                doneCond.wait_for(l, std::chrono::milliseconds(1),
+                                  [&]() { return job_done(job) || queued > 0; });
+            }
+            waiters--;
+        }
+    }
+};
+
+JobRef job_submit(JobFunc fun)
+{
+    return job_submit(std::move(fun), std::vector<JobRef>());
+}
+
+JobRef job_submit(JobFunc fun, const std::vector<JobRef> &deps)
+{
+    JobSystem &js = JobSystem::instance();
+    js.start();
+    JobRef job = std::make_shared<JobState>(std::move(fun));
+    foreach (const JobRef &dep, deps)
+    {
+        if (!dep)
+            continue;
+        std::lock_guard<std::mutex> l(dep->mutex);
+        if (!dep->done) {
+            job->pending++;
+            dep->continuations.push_back(job);
+        }
+    }
+    if (--job->pending == 0)
+        js.enqueue(JobRef(job));
+    return job;
+}
+
+bool job_done(const JobRef &job)
+{
+    if (!job)
+        return true;
+    std::lock_guard<std::mutex> l(job->mutex);
+    return job->done;
+}
+
+void job_wait(const JobRef &job)
+{
+    JobSystem::instance().wait(job);
+}
+
+int job_worker_count()
+{
+    JobSystem &js = JobSystem::instance();
+    js.start();
+    return js.threads.size();
+}
+
+void job_shutdown()
+{
+    JobSystem::instance().stop();
+}
+
+size_t vec_par_threshold()
+{
+    return max(1, (int)kVecParThreshold);
+}
+
+void parallel_for(int begin, int end, const std::function<void(int first, int last)> &fun, int grain)
+{
+    const int count = end - begin;
+    if (count <= 0)
+        return;
+    const int workers = job_worker_count();
+    if (grain <= 0)
+        grain = max(1, count / (4 * (workers + 1)));
+    const int chunks = (count + grain - 1) / grain;
+    if (workers == 0 || chunks <= 1) {
+        fun(begin, end);
+        return;
+    }
+
+    // a few jobs pull chunks until none are left, this thread helps
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int c; (c = next++) < chunks; )
+            fun(begin + c * grain, min(end, begin + (c + 1) * grain));
+    };
+    std::vector<JobRef> jobs;
+    for (int i=0; i<min(workers, chunks - 1); i++)
+        jobs.push_back(job_submit(work));
+    work();
+    foreach (const JobRef &job, jobs)
+        job_wait(job);
+}
+
+struct VecParNoDefault {
+    int value;
+    explicit VecParNoDefault(int v) : value(v) {}
+};
+
+bool vec_par_runtests()
+{
+#if IS_DEVEL
+    Report("Beginning Parallel Vec Tests");
+    const int size = 4 * (int)vec_par_threshold() + 3;
+    std::vector<int> ints;
+    std::vector<float> negs;
+    std::vector<double> ones;
+    for (int i=0; i<size; i++)
+    {
+        ints.push_back(i + 1);
+        negs.push_back(-1.f - (i % 97));
+        ones.push_back((i % 2) ? 2.0 : 0.5);
+    }
+    const auto plus = [](int a, int b) { return a + b; };
+    const long long total = (long long) size * (size + 1) / 2;
+
+    ASSERT(vec_foldl_par(ints, plus) == vec_foldl(ints, plus));
+    ASSERT(vec_foldl_par(ints, plus, 100) == vec_foldl(ints, plus, 100));
+
+    // INIT is a seed, not a per-slice identity
+    const auto fmax = [](float a, float b) { return max(a, b); };
+    ASSERT(vec_foldl_par(negs, fmax, std::numeric_limits<float>::lowest()) == -1.f);
+    const auto times = [](double a, double b) { return a * b; };
+    ASSERT(vec_foldl_par(ones, times, 1.0) == vec_foldl(ones, times, 1.0));
+
+    // accumulator differs from the element type
+    const auto count = [](long long n, int x) { return n + x; };
+    const auto lplus = [](long long a, long long b) { return a + b; };
+    ASSERT(vec_foldl_par(ints, count, 0LL) == total);
+    ASSERT(vec_foldl_par(ints, count, lplus, 0LL) == total);
+    ASSERT(vec_foldl_par<long long>(ints, count) == total);
+
+    // maps, including the serial fallbacks
+    const std::list<int> lst(ints.begin(), ints.end());
+    ASSERT(vec_map_par(ints, [](int x) { return x * 2; }) == vec_map(lst, [](int x) { return x * 2; }));
+    ASSERT(vec_map_par(lst, [](int x) { return x * 2; }).back() == 2 * size);
+    ASSERT(vec_map_par(ints, [](int x) { return VecParNoDefault(x); }).back().value == size);
+    ASSERT(vec_map_par(ints, [](int x) { return x % 2 == 0; })[1]);
+    Report("Ending Parallel Vec Tests");
+#endif
+    return true;
+}
+
+
+#if OL_LOCK_PROFILE
+
+struct LockStats {
+    enum { kBuckets = 16 };
+
+    string              name;
+    std::atomic<uint64> acquires;
+    std::atomic<uint64> contended;
+    std::atomic<uint64> waitNs;
+    std::atomic<uint64> maxWaitNs;
+    std::atomic<uint64> holdNs;
+    std::atomic<uint64> maxHoldNs;
+    std::atomic<uint>   waitHist[kBuckets];
+    std::atomic<uint>   holdHist[kBuckets];
+    std::mutex          ownerMutex;     // contended path only
+    std::map<string, uint64> owners;    // holder thread name -> times it made others wait
+};
+
+struct LockRegistry {
+    std::mutex                 mutex;
+    std::map<string, LockStats*> stats;
+
+    static LockRegistry &instance()
+    {
+        static LockRegistry *reg = new LockRegistry;
+        return *reg;
+    }
+};
+
+// bucket 0 is under 256ns, each following bucket doubles
+static int lockBucket(uint64 ns)
+{
+    return (ns < 256) ? 0 : min((int)LockStats::kBuckets - 1, findLeadingOne(ns) - 7);
+}
+
+static string lockBucketName(int bucket)
+{
+    const uint64 ns = 256ull << bucket;
+    return (ns < 1000) ? str_format("<%dns", (int)ns) :
+        (ns < 1000000) ? str_format("<%dus", (int)(ns / 1000)) :
+        str_format("<%dms", (int)(ns / 1000000));
+}
+
+static void atomicMax(std::atomic<uint64> &val, uint64 v)
+{
+    uint64 cur = val.load();
+    while (v > cur && !val.compare_exchange_weak(cur, v));
+}
+
+LockStats *lock_stats(const char* name)
+{
+    LockRegistry &reg = LockRegistry::instance();
+    std::lock_guard<std::mutex> l(reg.mutex);
+    LockStats *&st = reg.stats[name];
+    if (!st) {
+        st = new LockStats();
+        st->name = name;
+    }
+    return st;
+}
+
+uint64 lock_profile_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64 lock_profile_tid()
+{
+    static_assert(sizeof(std::size_t) <= sizeof(uint64), "");
+    return std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+}
+
+const char* lock_profile_thread_name()
+{
+#if TARGET_OS_IPHONE
+    return thread_current_name(); // no THREAD_LOCAL
+#else
+    // unnamed threads are cached too, so they don't take the name mutex every time
+    static THREAD_LOCAL const char* name = NULL;
+    static THREAD_LOCAL bool        looked = false;
+    if (!looked) {
+        name = thread_current_name();
+        looked = true;
+    }
+    return name;
+#endif
+}
+
+void lock_stats_acquire(LockStats *st, uint64 waitNs, bool contended, const char* owner)
+{
+    st->acquires++;
+    if (!contended)
+        return;
+    st->contended++;
+    st->waitNs += waitNs;
+    atomicMax(st->maxWaitNs, waitNs);
+    st->waitHist[lockBucket(waitNs)]++;
+    std::lock_guard<std::mutex> l(st->ownerMutex);
+    st->owners[owner ? owner : "unnamed"]++;
+}
+
+void lock_stats_release(LockStats *st, uint64 holdNs)
+{
+    st->holdNs += holdNs;
+    atomicMax(st->maxHoldNs, holdNs);
+    st->holdHist[lockBucket(holdNs)]++;
+}
+
+static string lockHistogram(const std::atomic<uint> *hist)
+{
+    string s;
+    for (int i=0; i<LockStats::kBuckets; i++)
+    {
+        const uint n = hist[i].load();
+        if (n)
+            s += str_format(" %s:%d", lockBucketName(i).c_str(), n);
+    }
+    return s;
+}
+
+string lock_profile_report(int count)
+{
+    std::vector<LockStats*> stats;
+    {
+        LockRegistry &reg = LockRegistry::instance();
+        std::lock_guard<std::mutex> l(reg.mutex);
+        foreach (auto &x, reg.stats)
+            stats.push_back(x.second);
+    }
+    vec_sort_key(stats, [](const LockStats *st) { return -(double)st->waitNs.load(); });
+
+    string s = str_format("%-24s %10s %8s %10s %10s %10s %10s\n", "lock", "acquires", "waited",
+                          "wait ms", "max wait", "hold avg", "max hold");
+    for (int i=0; i<min(count, (int)stats.size()); i++)
+    {
+        LockStats &st = *stats[i];
+        const uint64 acq = st.acquires.load();
+        if (!acq)
+            continue;
+        s += str_format("%-24s %10llu %7.1f%% %10.2f %8.1fus %8.1fus %8.1fus\n",
+                        st.name.c_str(), acq, 100.0 * st.contended.load() / acq,
+                        st.waitNs.load() / 1e6, st.maxWaitNs.load() / 1e3,
+                        st.holdNs.load() / 1e3 / acq, st.maxHoldNs.load() / 1e3);
+        s += "  wait:" + lockHistogram(st.waitHist) + "\n";
+        s += "  hold:" + lockHistogram(st.holdHist) + "\n";
+
+        std::vector<std::pair<string, uint64>> owners;
+        {
+            std::lock_guard<std::mutex> l(st.ownerMutex);
+            owners.assign(st.owners.begin(), st.owners.end());
+        }
+        if (owners.size())
+        {
+            vec_sort_key(owners, [](const std::pair<string, uint64> &o) { return -(double)o.second; });
+            s += "  held by:";
+            for (int j=0; j<min(3, (int)owners.size()); j++)
+                s += str_format(" %s (%llu)", owners[j].first.c_str(), owners[j].second);
+            s += "\n";
+        }
+    }
+    return s;
+}
+
+void lock_profile_reset()
+{
+    LockRegistry &reg = LockRegistry::instance();
+    std::lock_guard<std::mutex> l(reg.mutex);
+    foreach (auto &x, reg.stats)
+    {
+        LockStats &st = *x.second;
+        st.acquires = 0;
+        st.contended = 0;
+        st.waitNs = 0;
+        st.maxWaitNs = 0;
+        st.holdNs = 0;
+        st.maxHoldNs = 0;
+        for (int i=0; i<LockStats::kBuckets; i++) {
+            st.waitHist[i] = 0;
+            st.holdHist[i] = 0;
+        }
+        std::lock_guard<std::mutex> l1(st.ownerMutex);
+        st.owners.clear();
+    }
+}
+
+#else
+
+string lock_profile_report(int count)
+{
+    return "lock profiling is disabled (build with OL_LOCK_PROFILE)";
+}
+
+void lock_profile_reset()
+{
+}
+
+#endif
+
+
 static DEFINE_CVAR(int, kMempoolMaxChain, 15);
+static DEFINE_CVAR(int, kMempoolMagazineBatch, 32);
+static DEFINE_CVAR(bool, kMempoolReleaseEmpty, true);
+static DEFINE_CVAR(int, kFrameArenaBlockSize, 256 * 1024);
+// 0: malloc, 1: mmap + transparent huge pages, 2: try hugetlbfs first (linux only)
+static DEFINE_CVAR(int, kMempoolHugePages, 0);
+
+THREAD_LOCAL MemoryPool::Magazine *MemoryPool::s_magazines = NULL;
+
+// pools with magazines, indexed by MemoryPool::id
+struct MemoryPoolRegistry {
+    std::mutex  mutex;
+    MemoryPool *pools[64] = {};
+    uint        generations[64] = {};
+
+    static MemoryPoolRegistry &instance()
+    {
+        static MemoryPoolRegistry *reg = new MemoryPoolRegistry;
+        return *reg;
+    }
+};
+
+FrameArena *FrameArena::current()
+{
+#if TARGET_OS_IPHONE
+    return NULL;                // no THREAD_LOCAL
+#else
+    if (!s_frameArena)
+        s_frameArena = new FrameArena;
+    return s_frameArena;
+#endif
+}
+
+void frame_arena_reset()
+{
+#if !TARGET_OS_IPHONE
+    if (s_frameArena)
+        s_frameArena->reset();
+#endif
+}
+
+void FrameArena::newBlock(size_t size)
+{
+    Block *blk = (Block*) malloc(size);
+    if (!blk) {
+        Reportf("FrameArena: malloc(%#x) failed: %s", (int) size, strerror(errno));
+        OL_Terminate("Out of frame arena memory!");
+    }
+    blk->next = m_block;
+    blk->size = size;
+    m_block = blk;
+    m_ptr = (char*) (blk + 1);
+    m_end = (char*) blk + size;
+    m_capacity += size;
+}
+
+void FrameArena::freeBlocks()
+{
+    while (m_block) {
+        Block *next = m_block->next;
+        free(m_block);
+        m_block = next;
+    }
+    m_ptr = NULL;
+    m_end = NULL;
+    m_capacity = 0;
+}
+
+void *FrameArena::allocateSlow(size_t size, size_t align)
+{
+    newBlock(max((size_t) kFrameArenaBlockSize, sizeof(Block) + size + align));
+    return allocate(size, align);
+}
+
+void FrameArena::reset()
+{
+    m_peak = max(m_peak, m_used);
+    m_used = 0;
+    if (!m_block)
+        return;
+    if (m_block->next)
+    {
+        // overflowed into several blocks, replace them with one that fits everything
+        const size_t size = m_capacity;
+        freeBlocks();
+        newBlock(size);
+    }
+#if DEBUG
+    memset(m_block + 1, 0xcd, m_block->size - sizeof(Block));
+#endif
+    m_ptr = (char*) (m_block + 1);
+}
+
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+#if __linux__
+
+// mmap SIZE bytes aligned to huge pages, using hugetlbfs if requested and
+// available, else madvise for transparent huge pages
+// No first-touch placement, see MemoryPool in stl_ext.h
+static char *mapHugePages(size_t size, size_t *mapSize, bool *hugetlb)
+{
+    const size_t msize = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    *hugetlb = false;
+    if (kMempoolHugePages >= 2)
+    {
+        void *ptr = mmap(NULL, msize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            *mapSize = msize;
+            *hugetlb = true;
+            return (char*) ptr;
+        }
+        Reportf("mmap(MAP_HUGETLB, %.1fMB) failed, trying transparent huge pages: %s",
+                msize / (1024.0 * 1024.0), strerror(errno));
+    }
+
+    // over-allocate by a page and trim, so the pool starts on a huge page
+    char *ptr = (char*) mmap(NULL, msize + kHugePageSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        Reportf("mmap(%.1fMB) failed: %s", msize / (1024.0 * 1024.0), strerror(errno));
+        return NULL;
+    }
+    char *aligned = (char*) (((uintptr_t) ptr + kHugePageSize - 1) & ~(uintptr_t) (kHugePageSize - 1));
+    if (aligned > ptr)
+        munmap(ptr, aligned - ptr);
+    const size_t tail = (ptr + msize + kHugePageSize) - (aligned + msize);
+    if (tail)
+        munmap(aligned + msize, tail);
+    if (madvise(aligned, msize, MADV_HUGEPAGE))
+        Reportf("madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+    *mapSize = msize;
+    return aligned;
+}
+
+// bytes of the mapping at PTR backed by transparent huge pages
+static size_t getAnonHugeBytes(const void *ptr)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return 0;
+    char line[256];
+    bool found = false;
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long long lo = 0, hi = 0;
+        char dash = 0;
+        if (sscanf(line, "%llx%c%llx", &lo, &dash, &hi) == 3 && dash == '-')
+        {
+            if (found)
+                break;
+            found = (lo <= (uintptr_t) ptr && (uintptr_t) ptr < hi);
+        }
+        else if (found && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+#endif
+
+// write free list links for blocks [BEGIN, END)
+void MemoryPool::linkFree(size_t begin, size_t end)
+{
+    for (size_t i=begin; i<end; i++) {
+        ((Chunk*) &pool[i * element_size])->next = (i+1 < count) ? (Chunk*) &pool[(i+1) * element_size] : NULL;
+    }
+}
 
 size_t MemoryPool::create(size_t cnt)
 {
     if (pool)
         return count;
     count = cnt;
+#if __linux__
+    bool hugetlb = false;
+#endif
     do {
 #if _WIN32
         pool = (char*)VirtualAlloc(NULL, count * element_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
         if (!pool)
             ReportWin32Err1("VirtualAlloc", GetLastError(), __FILE__, __LINE__);
 #else
-        pool = (char*)malloc(count * element_size);
-        if (!pool)
-            Reportf("malloc(%#x) failed: %s", (int) (count * element_size), strerror(errno));
+#if __linux__
+        if (kMempoolHugePages)
+            pool = mapHugePages(count * element_size, &mapSize, &hugetlb);
+        else
 #endif
-        Reportf("Allocating MemoryPool[%d](%db, %d) %.1fMB: %s", 
-                index, (int)element_size, (int)count,
-                (element_size * count) / (1024.0 * 1024.0),
-                pool ? "OK" : "FAILED");
-        if (!pool)
+        {
+            pool = (char*)malloc(count * element_size);
+            if (!pool)
+                Reportf("malloc(%#x) failed: %s", (int) (count * element_size), strerror(errno));
+        }
+#endif
+        if (!pool) {
+            Reportf("Allocating MemoryPool[%d](%db, %d) %.1fMB: FAILED",
+                    index, (int)element_size, (int)count,
+                    (element_size * count) / (1024.0 * 1024.0));
             count /= 2;
+        }
     } while (count && !pool);
 
     ASSERT(count);
@@ -264,27 +1256,76 @@ size_t MemoryPool::create(size_t cnt)
         return 0;
 
     first = (Chunk*) pool;
+    if (trackLive)
+        live = (uint64*) calloc((count + 63) / 64, sizeof(uint64));
+
+    linkFree(0, count);
+
+    string pages = "4KB pages";
+#if __linux__
+    if (hugetlb) {
+        pages = "2MB hugetlb pages";
+    } else if (mapSize) {
+        const size_t huge = min(getAnonHugeBytes(pool), mapSize);
+        pages = str_format("%.0f%% 2MB transparent huge pages", 100.0 * huge / mapSize);
+    }
+#endif
+
+    Reportf("Allocating MemoryPool[%d](%db, %d) %.1fMB: OK, %s",
+            index, (int)element_size, (int)count,
+            (element_size * count) / (1024.0 * 1024.0), pages.c_str());
+
+    if (index == 0)
+    {
+        rangeCount = 0;
+        addRange(this);
 
-    for (int i=0; i<count-1; i++) {
-        ((Chunk*) &pool[i * element_size])->next = (Chunk*) &pool[(i+1) * element_size];
+        MemoryPoolRegistry &reg = MemoryPoolRegistry::instance();
+        std::lock_guard<std::mutex> l(reg.mutex);
+        for (int i=0; i<kMaxPools; i++)
+        {
+            if (!reg.pools[i]) {
+                reg.pools[i] = this;
+                id = i;
+                generation = ++reg.generations[i];
+                break;
+            }
+        }
+        if (id < 0)
+            Reportf("MemoryPool[%db]: more than %d pools, using locked allocation", (int)element_size, kMaxPools);
     }
-    ((Chunk*) &pool[(count-1) * element_size])->next = NULL;
     
     return count;
 }
 
 void MemoryPool::release()
 {
+    if (id >= 0)
+    {
+        // invalidates every thread's magazine for this pool
+        MemoryPoolRegistry &reg = MemoryPoolRegistry::instance();
+        std::lock_guard<std::mutex> l(reg.mutex);
+        reg.pools[id] = NULL;
+        reg.generations[id]++;
+        id = -1;
+    }
 #if _WIN32
     if (pool && !VirtualFree(pool, 0, MEM_RELEASE))
         ReportWin32Err1("VirtualFree", GetLastError(), __FILE__, __LINE__);
 #else
-    free(pool);
+    if (mapSize)
+        munmap(pool, mapSize);
+    else
+        free(pool);
 #endif
+    free(live);
     delete next;
     
     pool = NULL;
+    live = NULL;
+    mapSize = 0;
     next = NULL;
+    rangeCount = 0;
 }
 
 
@@ -293,72 +1334,326 @@ MemoryPool::~MemoryPool()
     release();
 }
 
+void MemoryPool::addRange(MemoryPool *mp)
+{
+    ASSERT(rangeCount < kMaxChain);
+    Range rg = { mp->pool, mp->pool + mp->count * element_size, mp };
+    int i = rangeCount++;
+    for (; i > 0 && ranges[i-1].begin > rg.begin; i--)
+        ranges[i] = ranges[i-1];
+    ranges[i] = rg;
+}
+
+void MemoryPool::removeRange(MemoryPool *mp)
+{
+    int i = 0;
+    while (i < rangeCount && ranges[i].pool != mp)
+        i++;
+    ASSERT(i < rangeCount);
+    for (; i < rangeCount - 1; i++)
+        ranges[i] = ranges[i+1];
+    rangeCount = max(0, rangeCount - 1);
+}
+
+MemoryPool *MemoryPool::findOwner(const void *pt) const
+{
+    // binary search, chain length is bounded by kMaxChain
+    const char *ptr = (const char*) pt;
+    int lo = 0, hi = rangeCount;
+    while (lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        if (ranges[mid].begin <= ptr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || ptr >= ranges[lo-1].end)
+        return NULL;
+    MemoryPool *mp = ranges[lo-1].pool;
+    ASSERT((ptr - mp->pool) % element_size == 0);
+    return mp;
+}
+
 bool MemoryPool::isInPool(const void *pt) const
 {
-    if (!pool)
+    ASSERT(index == 0);
+    std::lock_guard<profiled_mutex> l(mutex);
+    return findOwner(pt) != NULL;
+}
+
+void* MemoryPool::allocateLive()
+{
+    ASSERT(trackLive);
+    std::lock_guard<profiled_mutex> l(mutex);
+    Chunk *chunk = popFree();
+    MemoryPool *mp = findOwner(chunk);
+    const size_t idx = ((char*) chunk - mp->pool) / element_size;
+    mp->live[idx / 64] |= (uint64)1 << (idx % 64);
+    return (void*) chunk;
+}
+
+void MemoryPool::deallocateLive(void *ptr)
+{
+    ASSERT(trackLive);
+    std::lock_guard<profiled_mutex> l(mutex);
+    MemoryPool *mp = findOwner(ptr);
+    ASSERT(mp);
+    if (!mp)
+        return;
+    const size_t idx = ((char*) ptr - mp->pool) / element_size;
+    mp->live[idx / 64] &= ~((uint64)1 << (idx % 64));
+    pushFree((Chunk*) ptr);
+}
+
+bool MemoryPool::isLive(const void *ptr) const
+{
+    if (!trackLive)
         return false;
-    const char *ptr = (char*) pt;
-    const size_t idx = (ptr - pool) / element_size;
-    if (idx >= count)
-        return next ? next->isInPool(pt) : false;
-    ASSERT(pool + (idx  * element_size) == ptr);
-    return true;
+    std::lock_guard<profiled_mutex> l(mutex);
+    const MemoryPool *mp = findOwner(ptr);
+    if (!mp)
+        return false;
+    const size_t idx = ((const char*) ptr - mp->pool) / element_size;
+    return (mp->live[idx / 64] >> (idx % 64)) & 1;
 }
 
-void* MemoryPool::allocate()
+std::vector<MemoryPool::LiveChunk> MemoryPool::getLiveChunks() const
+{
+    std::lock_guard<profiled_mutex> l(mutex);
+    std::vector<LiveChunk> chunks;
+    for (int i=0; i<rangeCount; i++)
+    {
+        const MemoryPool *mp = ranges[i].pool;
+        chunks.push_back(LiveChunk{mp->pool, mp->count, mp->live});
+    }
+    return chunks;
+}
+
+std::vector<std::pair<size_t, size_t>> MemoryPool::getChunkOccupancy() const
 {
-    std::lock_guard<std::mutex> l(mutex);
+    std::lock_guard<profiled_mutex> l(mutex);
+    std::vector<std::pair<size_t, size_t>> occ;
+    for (const MemoryPool *mp=this; mp; mp = mp->next)
+        occ.push_back(make_pair(mp->used, mp->count));
+    return occ;
+}
 
-    if (!first) {
-        ASSERT(pool);
-        if (!next) {
-            if (index+1 >= kMempoolMaxChain) {
+// return an empty chained pool to the OS, if the rest of the chain has some slack
+void MemoryPool::releaseEmpty(MemoryPool *mp)
+{
+    size_t spare = 0;
+    MemoryPool *prev = NULL;
+    for (MemoryPool *it=this; it; it = it->next)
+    {
+        if (it->next == mp)
+            prev = it;
+        if (it != mp)
+            spare += it->count - it->used;
+    }
+    if (!prev || spare < mp->count / 2)
+        return;
+
+    Reportf("Releasing empty MemoryPool[%d](%db, %d) %.1fMB",
+            mp->index, (int)element_size, (int)mp->count,
+            (element_size * mp->count) / (1024.0 * 1024.0));
+    prev->next = mp->next;
+    mp->next = NULL;
+    removeRange(mp);
+    delete mp;
+}
+
+MemoryPool::Chunk *MemoryPool::popFree()
+{
+    MemoryPool *mp = this;
+    while (!mp->first)
+    {
+        ASSERT(mp->pool);
+        if (!mp->next) {
+            if (rangeCount >= min((int)kMempoolMaxChain, (int)kMaxChain)) {
                 ASSERT_FAILED("Memory Pool", "%d/%d pools allocated! No memory available",
-                              index+1, kMempoolMaxChain);
+                              rangeCount, kMempoolMaxChain);
                 OL_Terminate("Out of block memory! Pool limit hit.");
             }
-            next = new MemoryPool(element_size);
-            next->index = index+1;
-            if (!next->create(count)) {
-                delete next;
-                next = NULL;
+            mp->next = new MemoryPool(element_size);
+            mp->next->index = mp->index+1;
+            mp->next->trackLive = trackLive;
+            if (!mp->next->create(count)) {
+                delete mp->next;
+                mp->next = NULL;
                 OL_Terminate("Out of block memory! Allocation failed.");
             }
+            addRange(mp->next);
         }
-        return next->allocate();
+        mp = mp->next;
     }
 
-    Chunk *chunk = first;
-    first = first->next;
-    used++;
+    Chunk *chunk = mp->first;
+    mp->first = chunk->next;
+    mp->used++;
+    return chunk;
+}
+
+void MemoryPool::pushFree(Chunk *chunk)
+{
+    MemoryPool *mp = findOwner(chunk);
+    ASSERT(mp);
+    if (!mp)
+        return;
+
+    chunk->next = mp->first;
+    mp->first = chunk;
+    mp->used--;
+
+    // blocks in magazines count as used, so nothing references an empty pool
+    if (mp->used == 0 && mp != this && kMempoolReleaseEmpty && !trackLive)
+        releaseEmpty(mp);
+}
+
+MemoryPool::Magazine *MemoryPool::magazine()
+{
+#if TARGET_OS_IPHONE
+    return NULL;                // no THREAD_LOCAL
+#endif
+    if (id < 0)
+        return NULL;
+    if (!s_magazines)
+        s_magazines = new Magazine[kMaxPools];
+    Magazine *mag = &s_magazines[id];
+    if (mag->generation != generation)
+    {
+        // blocks belong to a released pool
+        *mag = Magazine();
+        mag->generation = generation;
+    }
+    return mag;
+}
+
+void MemoryPool::refill(Magazine &mag)
+{
+    const uint batch = (uint) max((int)kMempoolMagazineBatch, 1);
+    std::lock_guard<profiled_mutex> l(mutex);
+    for (uint i=0; i<batch; i++)
+    {
+        Chunk *chunk = popFree();
+        chunk->next = mag.head;
+        mag.head = chunk;
+        mag.count++;
+    }
+}
+
+void MemoryPool::drain(Magazine &mag, uint keep)
+{
+    std::lock_guard<profiled_mutex> l(mutex);
+    while (mag.count > keep)
+    {
+        Chunk *chunk = mag.head;
+        mag.head = chunk->next;
+        mag.count--;
+        pushFree(chunk);
+    }
+}
+
+void* MemoryPool::allocate()
+{
+    Magazine *mag = magazine();
+    if (!mag)
+    {
+        std::lock_guard<profiled_mutex> l(mutex);
+        return (void*) popFree();
+    }
+
+    if (!mag->head)
+        refill(*mag);
+    Chunk *chunk = mag->head;
+    mag->head = chunk->next;
+    mag->count--;
     return (void*) chunk;
 }
 
 void MemoryPool::deallocate(void *ptr)
 {
-    std::lock_guard<std::mutex> l(mutex);
-
-    if (!isInPool(ptr))
+    Magazine *mag = magazine();
+    if (!mag)
     {
-        ASSERT(next);
-        if (next)
-            next->deallocate(ptr);
+        std::lock_guard<profiled_mutex> l(mutex);
+        pushFree((Chunk*) ptr);
         return;
     }
 
+    // ownership is checked by pushFree when the magazine drains
+    const uint batch = (uint) max((int)kMempoolMagazineBatch, 1);
     Chunk *chunk = (Chunk*) ptr;
-    chunk->next = first;
-    first = chunk;
-    used--;
+    chunk->next = mag->head;
+    mag->head = chunk;
+    mag->count++;
+    if (mag->count >= 2 * batch)
+        drain(*mag, batch);
+}
+
+void MemoryPool::flushThreadCache()
+{
+    if (!s_magazines)
+        return;
+    MemoryPoolRegistry &reg = MemoryPoolRegistry::instance();
+    {
+        std::lock_guard<std::mutex> l(reg.mutex);
+        for (int i=0; i<kMaxPools; i++)
+        {
+            Magazine &mag = s_magazines[i];
+            if (mag.count && reg.pools[i] && mag.generation == reg.generations[i])
+                reg.pools[i]->drain(mag, 0);
+        }
+    }
+    delete[] s_magazines;
+    s_magazines = NULL;
 }
 
 // SerialCore.h
+static uint enum_hash(const char* str, size_t len)
+{
+    // FNV-1a, case insensitive
+    uint hash = 2166136261u;
+    for (size_t i=0; i<len; i++)
+        hash = (hash ^ (uint)std::toupper((uchar)str[i])) * 16777619u;
+    return hash;
+}
+
+// exact match, or match of STR converted to upper case if UPPER
+static bool enum_equals(const char* name, const char* str, size_t len, bool upper)
+{
+    for (size_t i=0; i<len; i++) {
+        const uchar c = upper ? std::toupper((uchar)str[i]) : (uchar)str[i];
+        if ((uchar)name[i] != c)
+            return false;
+    }
+    return name[len] == '\0';
+}
+
 EnumType::EnumType(std::initializer_list<Pair> el) : elems(el)
 {
-    foreach (const Pair &it, el)
+    uint size = 4;
+    while (size < 2 * elems.size())
+        size *= 2;
+    s2v.resize(size, 0);
+    s2vMask = size - 1;
+    
+    for (uint i=0; i<elems.size(); i++)
     {
-        s2v[it.first.str()] = it.second;
+        const Pair &it = elems[i];
         v2s[it.second] = it.first;
+
+        // later duplicates replace earlier ones
+        const char *name = it.first.c_str_nonnull();
+        const size_t len = strlen(name);
+        for (uint j=enum_hash(name, len);; j++)
+        {
+            uint &slot = s2v[j&s2vMask];
+            if (!slot || enum_equals(elems[slot-1].first.c_str_nonnull(), name, len, false)) {
+                slot = i + 1;
+                break;
+            }
+        }
     }
 
     // its a bitset if the first 4 values don't overlap
@@ -369,5 +1664,37 @@ EnumType::EnumType(std::initializer_list<Pair> el) : elems(el)
             m_isBitset = false;
         bit |= elems[i].second;
     }
+
+    // later single bit duplicates can never match, the first one clears the bit
+    for (uint i=0; i<arraySize(m_single); i++)
+        m_single[i] = ~0u;
+    for (uint i=0; i<elems.size(); i++)
+    {
+        const uint64 val = elems[i].second;
+        if (val && !(val & (val - 1)))
+        {
+            if (!(m_singleMask & val)) {
+                m_single[bit_ctz(val)] = i;
+                m_singleMask |= val;
+            }
+        }
+        else
+        {
+            m_multi.push_back(i);
+        }
+    }
 }
 
+uint64 EnumType::lookup(const char* str, size_t len, bool upper) const
+{
+    if (!str)
+        return ~0;
+    for (uint j=enum_hash(str, len);; j++)
+    {
+        const uint slot = s2v[j&s2vMask];
+        if (!slot)
+            return ~0;
+        if (enum_equals(elems[slot-1].first.c_str_nonnull(), str, len, upper))
+            return elems[slot-1].second;
+    }
+}
@@ -33,6 +33,7 @@
 #include <set>
 #include <algorithm>
 #include <type_traits>
+#include <atomic>
 
 // c++11 ranged for loop
 #define foreach(A, B) for (A : (B))
@@ -161,10 +162,33 @@ namespace std {
 template <typename T> bool copy_explicit_owner(const T* ptr) { return NULL; }
 template <typename T> bool copy_refcount(const T* ptr, int delta) { return false; }
 
+// derive from copy_shared for copy-on-write copy_ptr<T> with non-const T
+// Copying the copy_ptr shares the pointee and bumps an intrusive reference
+// count. Mutable access through a copy_ptr that is not the only reference
+// copies the pointee first. Const access never copies.
+struct DLLFACE copy_shared {
+
+    mutable std::atomic<int> m_copyRefs;
+
+    copy_shared() : m_copyRefs(1) {}
+    // a copy is a new object with its own count
+    copy_shared(const copy_shared&) : m_copyRefs(1) {}
+    copy_shared& operator=(const copy_shared&) { return *this; }
+};
+
+// overload resolution prefers the base pointer over void*, so these select
+// copy-on-write behavior for anything derived from copy_shared
+inline bool copy_shared_acquire(const copy_shared *v) { v->m_copyRefs++; return true; }
+inline bool copy_shared_acquire(const void *v) { return false; }
+inline bool copy_shared_release(const copy_shared *v) { return --v->m_copyRefs > 0; }
+inline bool copy_shared_release(const void *v) { return false; }
+inline bool copy_shared_unique(const copy_shared *v) { return v->m_copyRefs.load() == 1; }
+inline bool copy_shared_unique(const void *v) { return true; }
+
 template <typename T>
 bool copy_delete(T *v)
 {
-    if (!v || copy_explicit_owner(v) || copy_refcount(v, -1))
+    if (!v || copy_explicit_owner(v) || copy_refcount(v, -1) || copy_shared_release(v))
         return false;
     delete v;
     return true;
@@ -179,6 +203,7 @@ inline void deleteNull(T*& v)
 }
 
 template <typename T> struct watch_ptr;
+template <typename T> struct handle_ptr;
 
 template <typename T>
 inline void deleteNull(watch_ptr<T>& v)
@@ -188,20 +213,62 @@ inline void deleteNull(watch_ptr<T>& v)
     copy_delete(q);
 }
 
+template <typename T>
+inline void deleteNull(handle_ptr<T>& v)
+{
+    T *q = v.get();
+    v = NULL;
+    copy_delete(q);
+}
+
 // smart pointer supporting distributed and centralized ownership
 // overload copy_explicit_owner for explicit/centralized ownership
 // overload copy_refcount for reference counting
+// derive from copy_shared for copy-on-write
 // otherwise copy the object around and delete on destruction
 template <typename T>
 class copy_ptr final {
 
     T* m_ptr = NULL;
 
+    // const pointee for copy-on-write types, which must not be mutated through const access
+    template <typename U>
+    using ctype = typename std::conditional<std::is_base_of<copy_shared, U>::value, const U, U>::type;
+
+    // make m_ptr the only reference before mutable access
+    void detach() { detach1(std::is_base_of<copy_shared, T>()); }
+    void detach1(std::false_type) { }
+    void detach1(std::true_type)
+    {
+        if (m_ptr && !copy_shared_unique(m_ptr))
+        {
+            T *v = new T(*m_ptr);
+            copy_delete(m_ptr);
+            m_ptr = v;
+        }
+    }
+
     template <typename U>
     void assign1(const T* v, typename std::enable_if<!std::is_const<U>::value>::type* = 0) { *m_ptr = *v; }
     template <typename U>
     void assign1(const T* v, typename std::enable_if<std::is_const<U>::value>::type* = 0) { }
 
+    // SHARE is true when V is owned by another copy_ptr, so a copy-on-write
+    // pointee may be shared instead of copied
+    copy_ptr& assignFrom(const T* v, bool share)
+    {
+        if (m_ptr == v)
+            ;
+        else if (!v || copy_explicit_owner(v) || (std::is_const<T>::value && copy_refcount(v, +1)) ||
+                 (share && copy_shared_acquire(v)))
+            reset(const_cast<T*>(v));
+        else if (!std::is_const<T>::value && m_ptr && !copy_explicit_owner(m_ptr) && copy_shared_unique(m_ptr))
+            assign1<T>(v);
+        else
+            reset(new T(*v));
+        return *this;
+    }
+
 public:
 
     ~copy_ptr() { reset(); }
@@ -225,28 +292,18 @@ public:
         return *this;
     }
 
-    // copy data when assigning unless data has explicit owner
-    copy_ptr(const copy_ptr& o) { assign(o.m_ptr); }
-    explicit copy_ptr(const T *t) { assign(t); }
-    copy_ptr& operator=(const copy_ptr& o) { return assign(o.m_ptr); }
-    
-    copy_ptr& assign(const T* v)
-    {
-        if (m_ptr == v)
-            ;
-        else if (!v || copy_explicit_owner(v) || (std::is_const<T>::value && copy_refcount(v, +1)))
-            reset(const_cast<T*>(v));
-        else if (!std::is_const<T>::value && m_ptr && !copy_explicit_owner(m_ptr))
-            assign1<T>(v);
-        else
-            reset(new T(*v));
-        return *this;
-    }
+    // copy data when assigning unless data has explicit owner. Copying a
+    // copy_ptr shares a copy-on-write pointee, a raw pointer is always copied
+    copy_ptr(const copy_ptr& o) { assignFrom(o.m_ptr, true); }
+    explicit copy_ptr(const T *t) { assignFrom(t, false); }
+    copy_ptr& operator=(const copy_ptr& o) { return assignFrom(o.m_ptr, true); }
+    copy_ptr& assign(const T* v) { return assignFrom(v, false); }
     
     // forward assignment from pointee type - copy
     copy_ptr& operator=(const T& o)
     {
         ASSERT(!copy_explicit_owner(&o)); // technically fine, but we should be setting by pointer
+        detach();
         if (m_ptr)
             *m_ptr = o;
         else
@@ -258,6 +315,7 @@ public:
     copy_ptr& operator=(T&& o) NOEXCEPT
     {
         ASSERT(!copy_explicit_owner(&o)); // technically fine, but we should be setting by pointer
+        detach();
         if (m_ptr)
             *m_ptr = std::move(o);
         else
@@ -265,9 +323,11 @@ public:
         return *this;
     }
      
-    // it's a smart pointer
-    T& operator*()  const { return *m_ptr; }
-    T* operator->() const { return m_ptr; }
+    // it's a smart pointer. Non-const access copies a shared copy-on-write pointee
+    T& operator*()  { detach(); return *m_ptr; }
+    T* operator->() { detach(); return m_ptr; }
+    template <typename U=T> ctype<U>& operator*()  const { return *m_ptr; }
+    template <typename U=T> ctype<U>* operator->() const { return m_ptr; }
     bool operator==(const copy_ptr &o) const
     {
         return (m_ptr == o.m_ptr || (m_ptr && o.m_ptr && *m_ptr == *o.m_ptr)); 
@@ -276,8 +336,15 @@ public:
 
     explicit operator bool()           const { return m_ptr != NULL; }
 
-    T*  get() const { return m_ptr; }
-    T** getPtr()    { return &m_ptr; }
+    T*  get()       { detach(); return m_ptr; }
+    template <typename U=T> ctype<U>* get() const { return m_ptr; }
+    T** getPtr()    { detach(); return &m_ptr; }
+
+    // const access that never copies, e.g. for reading through a non-const copy_ptr
+    template <typename U=T> ctype<U>* cget() const { return m_ptr; }
+
+    // true if a copy-on-write pointee is shared with another copy_ptr
+    bool isShared() const { return m_ptr && !copy_shared_unique(m_ptr); }
 
     T* release()
     {
@@ -297,6 +364,7 @@ copy_ptr<T> make_copy(T* &&v)
 // watch_ptr is a smart pointer that automatically becomes NULL when it's pointee is deleted
 
 struct Watchable;
+struct sync_watch_base;
 
 struct DLLFACE watch_ptr_base {
 
@@ -311,7 +379,8 @@ protected:
 
 struct DLLFACE Watchable : public IDeletable {
 
-    mutable watch_ptr_base watch_list;
+    mutable watch_ptr_base   watch_list;
+    mutable sync_watch_base *sync_watch_list = NULL; // guarded by watch_stripe(this)
 
     void nullReferencesTo();
 
@@ -380,6 +449,602 @@ watch_ptr<T> make_watch(T* v)
     return p;
 }
 
+// sync_watch_ptr is a watch_ptr that may be held by a different thread than
+// the one deleting the pointee. Linking, unlinking and nulling are guarded by
+// one of a fixed set of striped locks, chosen by the pointee address.
+// Use lock() to keep the pointee from being nulled while using it. The
+// deleting thread must null references before destruction starts, by deferred
+// deletion (onQueueForDelete) or by calling nullReferencesTo() first.
+// Stripes are recursive, so the thread holding a lock() may link, unlink,
+// lock or delete through any stripe it already holds. Different pointees can
+// share a stripe, so holding two lock()s at once may deadlock against another
+// thread doing the same in the other order: hold one at a time.
+
+// stripe lock for watchers of P
+DLLFACE std::recursive_mutex &watch_stripe(const void *p);
+
+struct DLLFACE sync_watch_base {
+
+    std::atomic<const Watchable*> ptr;
+    sync_watch_base*              next = NULL; // guarded by watch_stripe(ptr)
+    sync_watch_base*              prev = NULL;
+
+    sync_watch_base() : ptr(NULL) {}
+
+protected:
+    void unlink();
+    void link(const Watchable* p);
+    void link(const sync_watch_base &o);
+
+    friend struct Watchable;
+};
+
+template <typename T>
+struct DLLFACE sync_watch_ptr final : public sync_watch_base {
+
+    ~sync_watch_ptr()
+    {
+        unlink();
+    }
+
+    // default construct to null
+    sync_watch_ptr() NOEXCEPT { }
+    sync_watch_ptr(std::nullptr_t) NOEXCEPT { }
+
+    explicit sync_watch_ptr(T *t) { link(t); }
+    sync_watch_ptr(const sync_watch_ptr &t) { link(t); }
+
+    sync_watch_ptr& operator=(T* t)
+    {
+        unlink();
+        link(t);
+        return *this;
+    }
+
+    sync_watch_ptr& operator=(const sync_watch_ptr& o)
+    {
+        if (&o != this) {
+            unlink();
+            link(o);
+        }
+        return *this;
+    }
+
+    // the pointee and its stripe lock. Nothing else can null or relink
+    // watchers of the pointee while this is alive, so keep it short.
+    struct Locked {
+        std::unique_lock<std::recursive_mutex> lock;
+        T*                                     ptr = NULL;
+
+        T* operator->() const { return ptr; }
+        T& operator*() const { return *ptr; }
+        explicit operator bool() const { return ptr != NULL; }
+    };
+
+    Locked lock() const
+    {
+        Locked lk;
+        for (;;)
+        {
+            const Watchable *p = ptr.load();
+            if (!p)
+                return lk;
+            lk.lock = std::unique_lock<std::recursive_mutex>(watch_stripe(p));
+            if (ptr.load() == p) {
+                lk.ptr = (T*) p;
+                return lk;
+            }
+            lk.lock.unlock();
+        }
+    }
+
+    bool operator==(const T* o)  const { return ptr.load() == o; }
+    explicit operator bool()     const { return ptr.load() != NULL; }
+
+    // unsynchronized, the pointee may be deleted at any time unless locked
+    T* get() const { return (T*) ptr.load(); }
+};
+
+bool watch_runtests();
+
+// handle_ptr is a generational handle alternative to watch_ptr
+// A Handleable object lazily takes a slot in a global table the first time a
+// handle to it is made. Handles store the slot index and its generation, and
+// deleting the object bumps the generation, which nulls every handle at once.
+// Handles are plain 64 bit values: copying does not touch the pointee, and
+// resolving is safe concurrently with deletion (though the caller must still
+// make sure the object outlives its use of the result).
+
+struct Handleable;
+
+struct DLLFACE HandleTable {
+
+    enum { kPageBits = 12, kPageSize = 1<<kPageBits, kMaxPages = 4096 };
+
+    struct Slot {
+        std::atomic<const Handleable*> ptr;
+        std::atomic<uint>              generation;
+    };
+
+    static std::atomic<Slot*> s_pages[kMaxPages];
+
+    // handle is (slot+1) << 32 | generation, 0 is null
+    static const Handleable *resolve(uint64 handle)
+    {
+        if (!handle)
+            return NULL;
+        const uint idx = (uint) (handle >> 32) - 1;
+        Slot &slot = s_pages[idx >> kPageBits].load(std::memory_order_acquire)[idx & (kPageSize - 1)];
+        const Handleable *ptr = slot.ptr.load(std::memory_order_acquire);
+        if (slot.generation.load(std::memory_order_acquire) != (uint) handle)
+            return NULL;
+        return ptr;
+    }
+
+    static uint64 allocate(const Handleable *ptr);
+    static void release(uint64 handle);
+    static size_t getSlotCount();
+};
+
+struct DLLFACE Handleable : public IDeletable {
+
+    mutable std::atomic<uint64> m_handle;
+
+    Handleable() : m_handle(0) {}
+    // copies get their own slot
+    Handleable(const Handleable&) : m_handle(0) {}
+    Handleable& operator=(const Handleable&) { return *this; }
+
+    uint64 getHandle() const;
+    void nullHandles();
+
+    void onQueueForDelete()
+    {
+        nullHandles();
+    }
+
+    ~Handleable()
+    {
+        nullHandles();
+    }
+};
+
+// smart pointer that automatically becomes NULL when it's pointee is deleted
+template <typename T>
+struct handle_ptr final {
+
+    uint64 handle = 0;
+
+    handle_ptr() NOEXCEPT { }
+    handle_ptr(std::nullptr_t) NOEXCEPT { }
+
+    explicit handle_ptr(const T *t) : handle(t ? t->getHandle() : 0) { }
+    template <typename U>
+    handle_ptr(const handle_ptr<U> &t) NOEXCEPT : handle(t.handle) { static_assert(std::is_base_of<T, U>::value, ""); }
+
+    handle_ptr& operator=(const T* t)
+    {
+        handle = t ? t->getHandle() : 0;
+        return *this;
+    }
+
+    // it's a smart pointer
+    T& operator*()                       const { return *get(); }
+    T* operator->()                      const { return get(); }
+    // handles compare by slot and generation, which never change, so they
+    // stay valid keys in ordered containers after the object is deleted. A
+    // dead handle compares equal to NULL, but not to other dead handles
+    bool operator==(const handle_ptr &o) const { return handle == o.handle; }
+    bool operator==(const T* o)          const { return get() == o; }
+    bool operator<(const handle_ptr &o)  const { return handle < o.handle; }
+    explicit operator bool()             const { return get() != NULL; }
+
+    T* get() const
+    {
+        return static_cast<T*>(const_cast<Handleable*>(HandleTable::resolve(handle)));
+    }
+};
+
+template <typename T> bool operator!=(const handle_ptr<T> &a, T* b) { return !(a == b); }
+template <typename T> bool operator!=(T* a, const handle_ptr<T> &b) { return !(b == a); }
+
+template <typename T>
+handle_ptr<T> make_handle(T* v)
+{
+    handle_ptr<T> p(v);
+    return p;
+}
+
+// small containers ////////////////////////////////////////////////////////////////////
+
+// vector with inline storage for N elements, for small collections that
+// should not touch the heap. Spills to the heap like std::vector when it
+// grows past N. Iterators are plain pointers.
+template <typename T, size_t N>
+class small_vector final {
+
+    static_assert(N > 0, "small_vector needs inline capacity");
+
+    T*     m_data;
+    size_t m_size     = 0;
+    size_t m_capacity = N;
+    typename std::aligned_storage<sizeof(T) * N, alignof(T)>::type m_inline;
+
+    T* inlineData() { return (T*) &m_inline; }
+    bool isInline() const { return m_data == (const T*) &m_inline; }
+
+    void grow(size_t cap)
+    {
+        cap = max(cap, m_capacity * 2);
+        T* data = (T*) ::operator new(cap * sizeof(T));
+        for (size_t i=0; i<m_size; i++) {
+            new (&data[i]) T(std::move(m_data[i]));
+            m_data[i].~T();
+        }
+        if (!isInline())
+            ::operator delete(m_data);
+        m_data = data;
+        m_capacity = cap;
+    }
+
+    void destroy(size_t begin, size_t end)
+    {
+        for (size_t i=begin; i<end; i++)
+            m_data[i].~T();
+    }
+
+public:
+
+    typedef T              value_type;
+    typedef size_t         size_type;
+    typedef ptrdiff_t      difference_type;
+    typedef T&             reference;
+    typedef const T&       const_reference;
+    typedef T*             pointer;
+    typedef const T*       const_pointer;
+    typedef T*             iterator;
+    typedef const T*       const_iterator;
+
+    small_vector() : m_data(inlineData()) {}
+    explicit small_vector(size_type n, const T& val=T()) : m_data(inlineData()) { resize(n, val); }
+    small_vector(std::initializer_list<T> il) : m_data(inlineData()) { assign(il.begin(), il.end()); }
+    template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    small_vector(It first, It last) : m_data(inlineData()) { assign(first, last); }
+
+    small_vector(const small_vector &o) : m_data(inlineData()) { assign(o.begin(), o.end()); }
+    small_vector(small_vector &&o) NOEXCEPT : m_data(inlineData()) { *this = std::move(o); }
+
+    ~small_vector()
+    {
+        clear();
+        if (!isInline())
+            ::operator delete(m_data);
+    }
+
+    small_vector& operator=(const small_vector &o)
+    {
+        if (&o != this)
+            assign(o.begin(), o.end());
+        return *this;
+    }
+
+    small_vector& operator=(small_vector &&o) NOEXCEPT
+    {
+        if (&o == this)
+            return *this;
+        clear();
+        if (!o.isInline())
+        {
+            // steal the heap buffer
+            if (!isInline())
+                ::operator delete(m_data);
+            m_data = o.m_data;
+            m_size = o.m_size;
+            m_capacity = o.m_capacity;
+            o.m_data = o.inlineData();
+            o.m_size = 0;
+            o.m_capacity = N;
+        }
+        else
+        {
+            for (size_t i=0; i<o.m_size; i++)
+                new (&m_data[i]) T(std::move(o.m_data[i]));
+            m_size = o.m_size;
+            o.clear();
+        }
+        return *this;
+    }
+
+    template <typename It>
+    void assign(It first, It last)
+    {
+        clear();
+        reserve(std::distance(first, last));
+        for (; first != last; ++first)
+            new (&m_data[m_size++]) T(*first);
+    }
+
+    iterator       begin()        { return m_data; }
+    iterator       end()          { return m_data + m_size; }
+    const_iterator begin()  const { return m_data; }
+    const_iterator end()    const { return m_data + m_size; }
+    const_iterator cbegin() const { return m_data; }
+    const_iterator cend()   const { return m_data + m_size; }
+
+    size_type size()     const { return m_size; }
+    size_type capacity() const { return m_capacity; }
+    bool      empty()    const { return m_size == 0; }
+    T*        data()           { return m_data; }
+    const T*  data()     const { return m_data; }
+
+    T&       operator[](size_type i)       { DASSERT(i < m_size); return m_data[i]; }
+    const T& operator[](size_type i) const { DASSERT(i < m_size); return m_data[i]; }
+    T&       front()       { return m_data[0]; }
+    const T& front() const { return m_data[0]; }
+    T&       back()        { return m_data[m_size-1]; }
+    const T& back()  const { return m_data[m_size-1]; }
+
+    void reserve(size_type cap)
+    {
+        if (cap > m_capacity)
+            grow(cap);
+    }
+
+    void clear()
+    {
+        destroy(0, m_size);
+        m_size = 0;
+    }
+
+    void resize(size_type n, const T& val=T())
+    {
+        if (n < m_size) {
+            destroy(n, m_size);
+        } else {
+            reserve(n);
+            for (size_t i=m_size; i<n; i++)
+                new (&m_data[i]) T(val);
+        }
+        m_size = n;
+    }
+
+    template <typename... Args>
+    T& emplace_back(Args&&... args)
+    {
+        if (m_size == m_capacity)
+        {
+            // args may refer to an element, construct before moving storage
+            T val(std::forward<Args>(args)...);
+            grow(m_size + 1);
+            return *new (&m_data[m_size++]) T(std::move(val));
+        }
+        return *new (&m_data[m_size++]) T(std::forward<Args>(args)...);
+    }
+
+    void push_back(const T& val) { emplace_back(val); }
+    void push_back(T&& val) { emplace_back(std::move(val)); }
+
+    void pop_back()
+    {
+        DASSERT(m_size);
+        m_data[--m_size].~T();
+    }
+
+    template <typename... Args>
+    iterator emplace(const_iterator pos, Args&&... args)
+    {
+        const size_t idx = pos - m_data;
+        if (idx == m_size) {
+            emplace_back(std::forward<Args>(args)...);
+            return m_data + idx;
+        }
+        T val(std::forward<Args>(args)...);
+        reserve(m_size + 1);
+        new (&m_data[m_size]) T(std::move(m_data[m_size-1]));
+        std::move_backward(m_data + idx, m_data + m_size - 1, m_data + m_size);
+        m_data[idx] = std::move(val);
+        m_size++;
+        return m_data + idx;
+    }
+
+    iterator insert(const_iterator pos, const T& val) { return emplace(pos, val); }
+    iterator insert(const_iterator pos, T&& val) { return emplace(pos, std::move(val)); }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        T* dst = m_data + (first - m_data);
+        const size_t count = last - first;
+        std::move(dst + count, end(), dst);
+        destroy(m_size - count, m_size);
+        m_size -= count;
+        return dst;
+    }
+
+    iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+    bool operator==(const small_vector &o) const
+    {
+        return m_size == o.m_size && std::equal(begin(), end(), o.begin());
+    }
+    bool operator!=(const small_vector &o) const { return !(*this == o); }
+    bool operator<(const small_vector &o) const
+    {
+        return std::lexicographical_compare(begin(), end(), o.begin(), o.end());
+    }
+};
+
+// sorted vector map. Lookup is a binary search over contiguous storage and
+// there is one allocation for the whole map, which beats std::map for small or
+// mostly read collections. Insertion and erasure are O(N) and invalidate
+// iterators. Unlike std::map, keys are mutable through iterators - don't.
+template <typename K, typename V, typename C=std::less<K>>
+class flat_map final {
+public:
+    typedef K                                         key_type;
+    typedef V                                         mapped_type;
+    typedef std::pair<K, V>                           value_type;
+    typedef C                                         key_compare;
+    typedef std::vector<value_type>                   container_type;
+    typedef typename container_type::size_type        size_type;
+    typedef typename container_type::iterator         iterator;
+    typedef typename container_type::const_iterator   const_iterator;
+
+private:
+    container_type m_data;
+    C              m_comp;
+
+    struct KeyLess {
+        const C &comp;
+        bool operator()(const value_type &a, const K &b) const { return comp(a.first, b); }
+        bool operator()(const K &a, const value_type &b) const { return comp(a, b.first); }
+    };
+
+public:
+
+    flat_map() {}
+    flat_map(std::initializer_list<value_type> il) { foreach (const value_type &x, il) insert(x); }
+    template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    flat_map(It first, It last) { for (; first != last; ++first) insert(*first); }
+
+    iterator       begin()       { return m_data.begin(); }
+    iterator       end()         { return m_data.end(); }
+    const_iterator begin() const { return m_data.begin(); }
+    const_iterator end()   const { return m_data.end(); }
+
+    size_type size()     const { return m_data.size(); }
+    bool      empty()    const { return m_data.empty(); }
+    void      clear()          { m_data.clear(); }
+    void      reserve(size_type n) { m_data.reserve(n); }
+    const container_type &data() const { return m_data; }
+
+    iterator lower_bound(const K& key) { return std::lower_bound(begin(), end(), key, KeyLess{m_comp}); }
+    const_iterator lower_bound(const K& key) const { return std::lower_bound(begin(), end(), key, KeyLess{m_comp}); }
+    iterator upper_bound(const K& key) { return std::upper_bound(begin(), end(), key, KeyLess{m_comp}); }
+    const_iterator upper_bound(const K& key) const { return std::upper_bound(begin(), end(), key, KeyLess{m_comp}); }
+
+    iterator find(const K& key)
+    {
+        iterator it = lower_bound(key);
+        return (it != end() && !m_comp(key, it->first)) ? it : end();
+    }
+
+    const_iterator find(const K& key) const
+    {
+        const_iterator it = lower_bound(key);
+        return (it != end() && !m_comp(key, it->first)) ? it : end();
+    }
+
+    size_type count(const K& key) const { return find(key) != end(); }
+
+    std::pair<iterator, bool> insert(const value_type &val)
+    {
+        iterator it = lower_bound(val.first);
+        if (it != end() && !m_comp(val.first, it->first))
+            return std::make_pair(it, false);
+        return std::make_pair(m_data.insert(it, val), true);
+    }
+
+    std::pair<iterator, bool> insert(value_type &&val)
+    {
+        iterator it = lower_bound(val.first);
+        if (it != end() && !m_comp(val.first, it->first))
+            return std::make_pair(it, false);
+        return std::make_pair(m_data.insert(it, std::move(val)), true);
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) { return insert(value_type(std::forward<Args>(args)...)); }
+
+    V& operator[](const K& key)
+    {
+        iterator it = lower_bound(key);
+        if (it == end() || m_comp(key, it->first))
+            it = m_data.insert(it, value_type(key, V()));
+        return it->second;
+    }
+
+    size_type erase(const K& key)
+    {
+        iterator it = find(key);
+        if (it == end())
+            return 0;
+        m_data.erase(it);
+        return 1;
+    }
+
+    iterator erase(const_iterator it) { return m_data.erase(it); }
+    iterator erase(const_iterator first, const_iterator last) { return m_data.erase(first, last); }
+
+    bool operator==(const flat_map &o) const { return m_data == o.m_data; }
+    bool operator!=(const flat_map &o) const { return m_data != o.m_data; }
+};
+
+// sorted vector set, see flat_map
+template <typename K, typename C=std::less<K>>
+class flat_set final {
+public:
+    typedef K                                         key_type;
+    typedef K                                         value_type;
+    typedef C                                         key_compare;
+    typedef std::vector<K>                            container_type;
+    typedef typename container_type::size_type        size_type;
+    typedef typename container_type::const_iterator   iterator;
+    typedef typename container_type::const_iterator   const_iterator;
+
+private:
+    container_type m_data;
+    C              m_comp;
+
+public:
+
+    flat_set() {}
+    flat_set(std::initializer_list<K> il) { foreach (const K &x, il) insert(x); }
+    template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    flat_set(It first, It last) { for (; first != last; ++first) insert(*first); }
+
+    const_iterator begin() const { return m_data.begin(); }
+    const_iterator end()   const { return m_data.end(); }
+
+    size_type size()     const { return m_data.size(); }
+    bool      empty()    const { return m_data.empty(); }
+    void      clear()          { m_data.clear(); }
+    void      reserve(size_type n) { m_data.reserve(n); }
+    const container_type &data() const { return m_data; }
+
+    const_iterator lower_bound(const K& key) const { return std::lower_bound(begin(), end(), key, m_comp); }
+    const_iterator upper_bound(const K& key) const { return std::upper_bound(begin(), end(), key, m_comp); }
+
+    const_iterator find(const K& key) const
+    {
+        const_iterator it = lower_bound(key);
+        return (it != end() && !m_comp(key, *it)) ? it : end();
+    }
+
+    size_type count(const K& key) const { return find(key) != end(); }
+
+    std::pair<iterator, bool> insert(const K &key)
+    {
+        const_iterator it = lower_bound(key);
+        if (it != end() && !m_comp(key, *it))
+            return std::make_pair(it, false);
+        return std::make_pair(iterator(m_data.insert(m_data.begin() + (it - begin()), key)), true);
+    }
+
+    size_type erase(const K& key)
+    {
+        const_iterator it = find(key);
+        if (it == end())
+            return 0;
+        m_data.erase(m_data.begin() + (it - begin()));
+        return 1;
+    }
+
+    iterator erase(const_iterator it) { return m_data.erase(m_data.begin() + (it - begin())); }
+
+    bool operator==(const flat_set &o) const { return m_data == o.m_data; }
+    bool operator!=(const flat_set &o) const { return m_data != o.m_data; }
+};
+
 
 // vector ///////////////////////////////////////////////////////////////////////////////
 
@@ -406,6 +1071,12 @@ inline bool vec_contains(const std::unordered_set<T> &v, const T& t)
     return v.count(t);
 }
 
+template <typename K, typename C, typename T>
+inline bool vec_contains(const flat_set<K, C> &v, const T& t)
+{
+    return v.count(t);
+}
+
 template <typename V, typename Fun>
 inline void vec_foreach(V& vec, Fun& fun)
 {
@@ -497,6 +1168,12 @@ inline bool vec_add(std::unordered_set<V> &v, const T& t)
     return v.insert(t).second;
 }
 
+template <typename K, typename C, typename T>
+inline bool vec_add(flat_set<K, C> &v, const T& t)
+{
+    return v.insert(t).second;
+}
+
 template <typename V, typename V1>
 inline bool vec_extend(V &v, const V1& t)
 {
@@ -1012,6 +1689,14 @@ inline T vec_sum(const std::vector<T>& v)
     return r;
 }
 
+template <typename T, size_t N>
+inline T vec_sum(const small_vector<T, N>& v)
+{
+    T r{};
+    for_ (x, v) { r += x; }
+    return r;
+}
+
 template <typename V, typename T=typename V::value_type, typename F>
 inline T vec_foldl(const V& v, F fun, T init=T())
 {
@@ -1225,6 +1910,14 @@ inline V &map_set(std::map<K, V> &m, const K& key, const V& val)
     return v;
 }
 
+template <typename K, typename V, typename C>
+inline V &map_set(flat_map<K, V, C> &m, const K& key, const V& val)
+{
+    V &v = m[key];
+    v = val;
+    return v;
+}
+
 template <typename M, typename K, typename V>
 inline typename M::mapped_type &map_setdefault(M &m, const K& key, const V& def=dummy_ref<V>())
 {
@@ -1338,6 +2031,12 @@ inline const K &set_set(std::set<K> &m, const K& key)
     return *m.insert(key).first;
 }
 
+template <typename K, typename C>
+inline const K &set_set(flat_set<K, C> &m, const K& key)
+{
+    return *m.insert(key).first;
+}
+
 template <typename V, typename V1>
 inline bool set_extend(V &v, const V1& t)
 {
@@ -1445,6 +2144,236 @@ OL_Thread thread_create(void *(*start_routine)(void *), void *arg);
 void thread_join(OL_Thread thread);
 const char* thread_current_name();
 
+// work stealing job system
+// A shared pool of kJobThreads workers (0 for one less than the cpu count,
+// the submitting thread does work too), started on first use. Each worker
+// has its own deque: it pushes and pops at the back and idle workers steal
+// from the front of the others. Waiting on a job runs other jobs instead of
+// blocking, so jobs may submit and wait on further jobs.
+
+struct JobState;
+typedef std::shared_ptr<JobState> JobRef;
+typedef std::function<void()> JobFunc;
+
+// run FUN on the pool, after every job in DEPS has finished
+JobRef job_submit(JobFunc fun);
+JobRef job_submit(JobFunc fun, const std::vector<JobRef> &deps);
+
+// run FUN after JOB finishes (continuation)
+inline JobRef job_then(const JobRef &job, JobFunc fun) { return job_submit(std::move(fun), {job}); }
+
+// block until JOB finishes, running other jobs meanwhile. NULL is finished
+void job_wait(const JobRef &job);
+bool job_done(const JobRef &job);
+
+// number of worker threads, starting the pool if needed (0 if single threaded)
+int job_worker_count();
+
+// finish queued jobs and stop the workers
+void job_shutdown();
+
+// call FUN(first, last) over subranges of [BEGIN, END) in parallel, returning
+// when all are done. GRAIN is the minimum subrange size (0 picks one)
+void parallel_for(int begin, int end, const std::function<void(int first, int last)> &fun, int grain=0);
+
+// parallel versions of vec_* helpers, with the same arguments. Elements are
+// processed concurrently on the job system, so FUN / PRED / GKEY must be safe
+// to call from several threads at once. Vectors smaller than
+// vec_par_threshold() (kVecParThreshold) use the serial version.
+size_t vec_par_threshold();
+
+// true if V has random access iterators, which the parallel versions need to split it
+template <typename V>
+using vec_random_access = std::is_base_of<std::random_access_iterator_tag,
+    typename std::iterator_traits<decltype(std::begin(std::declval<const V&>()))>::iterator_category>;
+
+template <typename R, typename T, typename Fun>
+inline std::vector<R> vec_map_par1(const T &inv, const Fun &fun, std::false_type)
+{
+    return vec_map(inv, fun);
+}
+
+template <typename R, typename T, typename Fun>
+inline std::vector<R> vec_map_par1(const T &inv, const Fun &fun, std::true_type)
+{
+    const size_t size = vec_size(inv);
+    if (size < vec_par_threshold())
+        return vec_map(inv, fun);
+    std::vector<R> outs(size);
+    auto in = std::begin(inv);
+    parallel_for(0, (int)size, [&](int first, int last) {
+            for (int i=first; i<last; i++)
+                outs[i] = fun(in[i]);
+        });
+    return outs;
+}
+
+// results are written in place, so R must be default constructible. vector<bool>
+// elements share words, so writing them concurrently races: those run serially
+template <typename T, typename Fun>
+inline auto vec_map_par(const T &inv, const Fun &fun) -> std::vector<decltype(fun(*std::begin(inv)))>
+{
+    typedef decltype(fun(*std::begin(inv))) R;
+    return vec_map_par1<R>(inv, fun, std::integral_constant<bool, vec_random_access<T>::value &&
+                           std::is_default_constructible<R>::value && !std::is_same<R, bool>::value>());
+}
+
+// fold [0, SIZE) in slices on the job system with SLICE(begin, end) -> T, then
+// fold the slice results into INIT in order with COMBINE(T, T)
+template <typename T, typename S, typename C>
+inline T vec_foldl_slices(size_t size, const S &slice, const C &combine, T init)
+{
+    const int parts = job_worker_count() + 1;
+    const size_t step = (size + parts - 1) / parts;
+    const int slices = (int) ((size + step - 1) / step); // none empty
+    std::vector<T> partial(slices);
+    parallel_for(0, slices, [&](int first, int last) {
+            for (int p=first; p<last; p++)
+                partial[p] = slice(p * step, min(size, (p + 1) * step));
+        }, 1);
+    foreach (const T &x, partial)
+        init = combine(init, x);
+    return init;
+}
+
+template <typename V, typename T, typename F>
+inline T vec_foldl_par1(const V& v, const F& fun, T init, std::false_type)
+{
+    return vec_foldl(v, fun, init);
+}
+
+template <typename V, typename T, typename F>
+inline T vec_foldl_par1(const V& v, const F& fun, T init, std::true_type)
+{
+    const size_t size = vec_size(v);
+    if (size < vec_par_threshold())
+        return vec_foldl(v, fun, init);
+    auto in = std::begin(v);
+    return vec_foldl_slices(size, [&](size_t begin, size_t end) {
+            T acc = in[begin];
+            for (size_t i=begin + 1; i<end; i++)
+                acc = fun(acc, in[i]);
+            return acc;
+        }, fun, init);
+}
+
+template <typename V, typename T, typename F, typename C>
+inline T vec_foldl_par2(const V& v, const F& fun, const C& combine, T identity, std::false_type)
+{
+    return vec_foldl(v, fun, identity);
+}
+
+template <typename V, typename T, typename F, typename C>
+inline T vec_foldl_par2(const V& v, const F& fun, const C& combine, T identity, std::true_type)
+{
+    const size_t size = vec_size(v);
+    if (size < vec_par_threshold())
+        return vec_foldl(v, fun, identity);
+    auto in = std::begin(v);
+    return vec_foldl_slices(size, [&](size_t begin, size_t end) {
+            T acc = identity;
+            for (size_t i=begin; i<end; i++)
+                acc = fun(acc, in[i]);
+            return acc;
+        }, combine, identity);
+}
+
+// for folds whose accumulator is not the element type, e.g. counting. Each
+// slice is folded with FUN(T, element) starting from IDENTITY, then the slices
+// are folded with COMBINE(T, T), which must be associative with IDENTITY as
+// its identity. Same result as vec_foldl(v, fun, identity)
+template <typename V, typename T, typename F, typename C>
+inline T vec_foldl_par(const V& v, F fun, C combine, T identity)
+{
+    return vec_foldl_par2(v, fun, combine, identity, std::integral_constant<bool,
+                          vec_random_access<V>::value && !std::is_same<T, bool>::value &&
+                          std::is_default_constructible<T>::value>());
+}
+
+// FUN must be associative. Each slice is seeded with its first element and
+// the slices are folded into INIT in order, so any INIT valid for vec_foldl
+// works. Runs serially unless T is the element type
+template <typename V, typename T=typename V::value_type, typename F>
+inline T vec_foldl_par(const V& v, F fun, T init=T())
+{
+    typedef typename std::decay<decltype(*std::begin(v))>::type E;
+    return vec_foldl_par1(v, fun, init, std::integral_constant<bool,
+                          vec_random_access<V>::value && std::is_same<T, E>::value &&
+                          !std::is_same<T, bool>::value && std::is_default_constructible<T>::value>());
+}
+
+template <typename R, typename Vec, typename Fun>
+inline R vec_foldl_par(const Vec &vec, const Fun & fun)
+{
+    return vec_foldl_par(vec, fun, R());
+}
+
+bool vec_par_runtests();
+
+// sort slices in parallel, then merge neighbouring slices pairwise
+template <typename T, typename F>
+inline void vec_sort_key_par(T& col, const F& gkey)
+{
+    const size_t size = vec_size(col);
+    if (size < vec_par_threshold()) {
+        vec_sort_key(col, gkey);
+        return;
+    }
+    auto comp = [&](const typename T::value_type &a, const typename T::value_type &b) {
+        return gkey(a) < gkey(b);
+    };
+    const int parts = job_worker_count() + 1;
+    std::vector<size_t> bounds;
+    for (int p=0; p<=parts; p++)
+        bounds.push_back(size * p / parts);
+    auto beg = std::begin(col);
+    parallel_for(0, parts, [&](int first, int last) {
+            for (int p=first; p<last; p++)
+                std::sort(beg + bounds[p], beg + bounds[p+1], comp);
+        }, 1);
+    for (int width=1; width<parts; width *= 2)
+    {
+        const int merges = (parts + 2 * width - 1) / (2 * width);
+        parallel_for(0, merges, [&](int first, int last) {
+                for (int m=first; m<last; m++)
+                {
+                    const size_t lo = bounds[m * 2 * width];
+                    const size_t mid = bounds[min(parts, m * 2 * width + width)];
+                    const size_t hi = bounds[min(parts, (m + 1) * 2 * width)];
+                    if (mid < hi)
+                        std::inplace_merge(beg + lo, beg + mid, beg + hi, comp);
+                }
+            }, 1);
+    }
+}
+
+// PRED runs in parallel, then survivors are compacted in order (vec_pop_if
+// does not maintain order, so this is a valid result for it too)
+template <typename T, typename F>
+inline int vec_pop_if_par(T &vec, F pred)
+{
+    const size_t size = vec.size();
+    if (size < vec_par_threshold())
+        return vec_pop_if(vec, pred);
+    std::vector<char> pop(size);
+    parallel_for(0, (int)size, [&](int first, int last) {
+            for (int i=first; i<last; i++)
+                pop[i] = pred(vec[i]) ? 1 : 0;
+        });
+    size_t keep = 0;
+    for (size_t i=0; i<size; i++)
+    {
+        if (pop[i])
+            continue;
+        if (i != keep)
+            vec[keep] = std::move(vec[i]);
+        keep++;
+    }
+    while (vec.size() > keep)
+        vec.pop_back();
+    return size - keep;
+}
+
 // adapted from boost::reverse_lock
 template<typename Lock>
 class reverse_lock
@@ -1514,22 +2443,200 @@ typedef std::recursive_mutex rmutex;
 
 #define ASSERT_LOCKED(M) DASSERT((M).is_mine())
 
+// lock contention profiling
+// profiled_mutex and profiled_rmutex replace std::mutex and rmutex. Locks
+// sharing a name share statistics: acquisitions, how often they had to wait,
+// wait and hold time histograms, and which threads (thread_current_name) held
+// the lock while others waited. See lock_profile_report() and the
+// lock_report console command. Without OL_LOCK_PROFILE (release builds)
+// they are the plain mutex types.
+#ifndef OL_LOCK_PROFILE
+#define OL_LOCK_PROFILE DEBUG
+#endif
+
+// worst COUNT locks by total wait time
+string lock_profile_report(int count=10);
+void lock_profile_reset();
+
+#if OL_LOCK_PROFILE
+
+struct LockStats;
+LockStats *lock_stats(const char* name);
+void lock_stats_acquire(LockStats *st, uint64 waitNs, bool contended, const char* owner);
+void lock_stats_release(LockStats *st, uint64 holdNs);
+uint64 lock_profile_now();      // nanoseconds
+uint64 lock_profile_tid();      // current thread id, never 0
+const char* lock_profile_thread_name(); // cached thread_current_name()
+
+template <typename M>
+class profiled_mutex_t final {
+
+    M                   m_mutex;
+    LockStats          *m_stats;
+    std::atomic<uint64>      m_owner;     // holding thread, 0 if unlocked
+    std::atomic<const char*> m_ownerName;
+    uint64                   m_lockedAt = 0; // guarded by m_mutex
+    int                      m_depth    = 0;
+
+    void acquired(uint64 tid, uint64 waitNs, bool contended, const char* owner)
+    {
+        if (m_depth++)
+            return;             // recursive
+        m_owner = tid;
+        m_ownerName = lock_profile_thread_name();
+        m_lockedAt = lock_profile_now();
+        lock_stats_acquire(m_stats, waitNs, contended, owner);
+    }
+
+public:
+
+    explicit profiled_mutex_t(const char* name) : m_stats(lock_stats(name)), m_owner(0), m_ownerName(NULL) {}
+    profiled_mutex_t(const profiled_mutex_t&) = delete;
+    profiled_mutex_t& operator=(const profiled_mutex_t&) = delete;
+
+    void lock()
+    {
+        const uint64 tid = lock_profile_tid();
+        if (m_mutex.try_lock()) {
+            acquired(tid, 0, false, NULL);
+            return;
+        }
+        const char* owner = m_ownerName.load();
+        const uint64 start = lock_profile_now();
+        m_mutex.lock();
+        acquired(tid, lock_profile_now() - start, true, owner);
+    }
+
+    bool try_lock()
+    {
+        if (!m_mutex.try_lock())
+            return false;
+        acquired(lock_profile_tid(), 0, false, NULL);
+        return true;
+    }
+
+    void unlock()
+    {
+        if (--m_depth == 0) {
+            m_owner = 0;
+            lock_stats_release(m_stats, lock_profile_now() - m_lockedAt);
+        }
+        m_mutex.unlock();
+    }
+
+    bool is_locked() const { return m_owner.load() != 0; }
+    bool is_mine() const { return m_owner.load() == lock_profile_tid(); }
+};
+
+#else
+
+// plain mutex, keeps the holder so ASSERT_LOCKED works without profiling
+template <typename M>
+class profiled_mutex_t final {
+
+    M                            m_mutex;
+    std::atomic<std::thread::id> m_owner;
+    int                          m_depth = 0; // guarded by m_mutex
+
+public:
+
+    explicit profiled_mutex_t(const char* name) : m_owner(std::thread::id()) {}
+    profiled_mutex_t(const profiled_mutex_t&) = delete;
+    profiled_mutex_t& operator=(const profiled_mutex_t&) = delete;
+
+    void lock()
+    {
+        m_mutex.lock();
+        if (m_depth++ == 0)
+            m_owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    }
+
+    bool try_lock()
+    {
+        if (!m_mutex.try_lock())
+            return false;
+        if (m_depth++ == 0)
+            m_owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+        return true;
+    }
+
+    void unlock()
+    {
+        if (--m_depth == 0)
+            m_owner.store(std::thread::id(), std::memory_order_relaxed);
+        m_mutex.unlock();
+    }
+
+    bool is_locked() const { return m_owner.load(std::memory_order_relaxed) != std::thread::id(); }
+    bool is_mine() const { return m_owner.load(std::memory_order_relaxed) == std::this_thread::get_id(); }
+};
+
+#endif
+
+typedef profiled_mutex_t<std::mutex> profiled_mutex;
+typedef profiled_mutex_t<std::recursive_mutex> profiled_rmutex;
+
 
 // pooled memory allocator
+// Each thread keeps a small cache (magazine) of free blocks per pool, refilled
+// from and drained to the shared free lists in batches, so the common
+// allocate/deallocate path takes no lock.
+// With kMempoolHugePages (linux), pools are mmapped on 2MB boundaries and
+// backed by transparent or hugetlbfs huge pages. Pages are first touched by
+// the thread that grows the chain, so they live on that thread's NUMA node;
+// spreading them with first-touch placement is not done, since job workers
+// are not pinned to nodes and chained pools are created under the pool mutex.
 class MemoryPool final {
 
     struct Chunk final {
         Chunk *next;
     };
 
-    std::mutex    mutex;
+    struct Magazine {
+        Chunk *head       = NULL;
+        uint   count      = 0;
+        uint   generation = 0;  // matches pool generation, else contents are stale
+    };
+
+    // address range of one pool in the chain
+    struct Range {
+        const char *begin;
+        const char *end;
+        MemoryPool *pool;
+    };
+
+    enum { kMaxPools = 64 };    // pools with magazines (heads of chains)
+    enum { kMaxChain = 64 };    // hard limit for kMempoolMaxChain
+
+    static THREAD_LOCAL Magazine *s_magazines;
+
+    mutable profiled_mutex mutex { "MemoryPool" }; // guards free lists and ranges of the whole chain (head only)
     const size_t  element_size;
     size_t        count = 0;
-    size_t        used  = 0;
+    size_t        used  = 0;    // blocks not in the shared free list (includes magazines)
     char         *pool  = NULL;
     Chunk        *first = NULL;
     MemoryPool   *next  = NULL; // next pool
     int           index = 0;    // index in pool chain
+    int           id    = -1;   // magazine slot, -1 if none
+    uint          generation = 0;
+    Range         ranges[kMaxChain]; // every pool in the chain sorted by address (head only)
+    int           rangeCount = 0;
+    uint64       *live  = NULL; // bit per allocated block, if trackLive
+    size_t        mapSize = 0;  // nonzero if pool was mmapped (huge pages)
+    bool          trackLive = false;
+
+    void linkFree(size_t begin, size_t end);
+    MemoryPool *findOwner(const void *ptr) const; // mutex held
+    void addRange(MemoryPool *mp);
+    void removeRange(MemoryPool *mp);
+    void releaseEmpty(MemoryPool *mp);
+
+    Magazine *magazine();
+    void refill(Magazine &mag);
+    void drain(Magazine &mag, uint keep);
+    Chunk *popFree();           // mutex held
+    void pushFree(Chunk *chunk);  // mutex held
 
 public:
 
@@ -1557,13 +2664,44 @@ public:
         return (T*)(pool + count * element_size);
     }
 
+    // true if PT is a block of any pool in the chain. Head pool only, chained
+    // pools don't track ranges
     bool isInPool(const void *pt) const;
 
+    // keep a bitmap of allocated blocks so live blocks can be iterated (see
+    // ObjectPool). Call before create(). Tracked pools never release empty
+    // chained pools, so block addresses stay valid while iterating.
+    void setTrackLive() { ASSERT(!pool); trackLive = true; }
+
+    // like allocate/deallocate, but also update the bitmap. Bypasses the magazine
+    void* allocateLive();
+    void deallocateLive(void *ptr);
+    bool isLive(const void *ptr) const;
+
+    // blocks of one pool in the chain and their liveness bitmap
+    struct LiveChunk {
+        char         *begin;
+        size_t        count;
+        const uint64 *live;
+    };
+
+    // every pool in the chain, in address order
+    std::vector<LiveChunk> getLiveChunks() const;
+
+    // (used, count) for each pool in the chain
+    std::vector<std::pair<size_t, size_t>> getChunkOccupancy() const;
+
     void* allocate();           // return a block of element_size bytes
     void deallocate(void *ptr); // free a block returned by allocate()
 
     void release();
 
+    // return this thread's cached blocks to their pools (called by
+    // thread_cleanup). Threads that never call it, including the main thread,
+    // keep up to 2*kMempoolMagazineBatch blocks per pool until exit; those
+    // count as used and keep their chained pool from being released.
+    static void flushThreadCache();
+
     friend void* operator new(size_t nbytes, MemoryPool& mp)
     {
         ASSERT(nbytes == mp.getElementSize());
@@ -1577,6 +2715,250 @@ public:
     
 };
 
+// per-thread linear allocator for temporaries that live at most one frame
+// Allocation bumps a pointer and deallocation only gives back the most recent
+// allocation. Everything is freed at once by frame_arena_reset(), called from
+// OL_ThreadEndIteration. Blocks are kept between frames, so code that opts in
+// (see arena_vector, arena_string) does no heap allocation in steady state.
+class FrameArena final {
+
+    struct Block {
+        Block  *next;
+        size_t  size;
+    };
+
+    Block  *m_block    = NULL;  // current block, earlier blocks follow
+    char   *m_ptr      = NULL;
+    char   *m_end      = NULL;
+    size_t  m_used     = 0;     // bytes allocated this frame
+    size_t  m_peak     = 0;
+    size_t  m_capacity = 0;
+
+    void newBlock(size_t size);
+    void freeBlocks();
+    void *allocateSlow(size_t size, size_t align);
+
+public:
+
+    FrameArena() {}
+    ~FrameArena() { freeBlocks(); }
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // this thread's arena, NULL if unsupported (no THREAD_LOCAL)
+    static FrameArena *current();
+
+    void *allocate(size_t size, size_t align)
+    {
+        char *ptr = (char*) (((uintptr_t) m_ptr + align - 1) & ~(uintptr_t) (align - 1));
+        if (!m_ptr || ptr + size > m_end)
+            return allocateSlow(size, align);
+        m_ptr = ptr + size;
+        m_used += size;
+        return ptr;
+    }
+
+    void deallocate(void *ptr, size_t size)
+    {
+        if ((char*) ptr + size == m_ptr) {
+            m_ptr = (char*) ptr;
+            m_used -= size;
+        }
+    }
+
+    // free everything allocated this frame
+    void reset();
+
+    size_t getUsed() const { return m_used; }
+    size_t getPeak() const { return max(m_peak, m_used); }
+    size_t getCapacity() const { return m_capacity; }
+};
+
+// reset this thread's FrameArena
+void frame_arena_reset();
+
+// STL allocator in a FrameArena, the calling thread's by default. Falls back
+// to the heap where there is no arena
+template <typename T>
+struct arena_allocator {
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind { typedef arena_allocator<U> other; };
+
+    FrameArena *arena;
+
+    arena_allocator() : arena(FrameArena::current()) {}
+    explicit arena_allocator(FrameArena *ar) : arena(ar) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U> &o) : arena(o.arena) {}
+
+    T* allocate(size_t n)
+    {
+        if (!arena)
+            return (T*) ::operator new(n * sizeof(T));
+        return (T*) arena->allocate(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T* ptr, size_t n)
+    {
+        if (arena)
+            arena->deallocate(ptr, n * sizeof(T));
+        else
+            ::operator delete(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const arena_allocator<U> &o) const { return arena == o.arena; }
+    template <typename U>
+    bool operator!=(const arena_allocator<U> &o) const { return arena != o.arena; }
+};
+
+// containers for per-frame temporaries. They allocate from the creating
+// thread's arena, so they must not outlive the frame (frame_arena_reset) and
+// must not be grown or freed on another thread, including being handed to a
+// job. The arena itself is deleted by thread_cleanup.
+template <typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char>> arena_string;
+
+// index of lowest set bit. X must be nonzero
+inline int bit_ctz(uint64 x)
+{
+#if _MSC_VER
+    unsigned long idx;
+    _BitScanForward64(&idx, x);
+    return (int)idx;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+// typed pool of T, with iteration over live objects in address order
+// Objects are constructed in place inside MemoryPool blocks and tracked in a
+// per-chunk bitmap, so systems can update every pooled object with a linear
+// walk instead of chasing pointer lists. construct/destroy may be called from
+// any thread, but not while iterating.
+template <typename T>
+class ObjectPool final {
+
+    MemoryPool m_pool;
+
+public:
+
+    // a run of bitmap words inside one chunk, the unit of parallel iteration
+    struct Range {
+        char         *begin;    // first block of the chunk
+        const uint64 *live;
+        size_t        word;
+        size_t        wordEnd;
+    };
+
+    ObjectPool() : m_pool(sizeof(T))
+    {
+        static_assert(sizeof(T) >= sizeof(void*), "ObjectPool element too small");
+        // blocks are sizeof(T) apart from a malloc/mmap base, so only fundamental alignment holds
+        static_assert(alignof(T) <= alignof(std::max_align_t), "ObjectPool element overaligned");
+        m_pool.setTrackLive();
+    }
+
+    ~ObjectPool() { clear(); }
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    // allocate a pool containing CNT objects (chained pools are added as needed)
+    size_t create(size_t cnt) { return m_pool.create(cnt); }
+
+    template <typename... Args>
+    T* construct(Args&&... args)
+    {
+        return new (m_pool.allocateLive()) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *obj)
+    {
+        if (!obj)
+            return;
+        obj->~T();
+        m_pool.deallocateLive(obj);
+    }
+
+    bool isLive(const T *obj) const { return m_pool.isLive(obj); }
+    size_t size() const { return m_pool.getUsed(); }
+    bool empty() const { return size() == 0; }
+    size_t getCapacity() const
+    {
+        size_t cap = 0;
+        foreach (const auto &occ, m_pool.getChunkOccupancy())
+            cap += occ.second;
+        return cap;
+    }
+
+    // split the pool into about PARTS ranges of equal address span
+    std::vector<Range> getRanges(int parts) const
+    {
+        const std::vector<MemoryPool::LiveChunk> chunks = m_pool.getLiveChunks();
+        size_t words = 0;
+        foreach (const MemoryPool::LiveChunk &ch, chunks)
+            words += (ch.count + 63) / 64;
+        parts = max(1, parts);
+        const size_t step = max((size_t)1, (words + parts - 1) / parts);
+
+        std::vector<Range> rgs;
+        foreach (const MemoryPool::LiveChunk &ch, chunks)
+        {
+            const size_t cwords = (ch.count + 63) / 64;
+            for (size_t w=0; w<cwords; w += step)
+                rgs.push_back(Range{ch.begin, ch.live, w, min(cwords, w + step)});
+        }
+        return rgs;
+    }
+
+    // call FUN(T&) for every live object in RG, in address order
+    template <typename F>
+    static void forEachRange(const Range &rg, const F &fun)
+    {
+        for (size_t w=rg.word; w<rg.wordEnd; w++)
+        {
+            // copy so FUN may destroy the object it is passed
+            uint64 bits = rg.live[w];
+            while (bits)
+            {
+                const size_t idx = w * 64 + bit_ctz(bits);
+                bits &= bits - 1;
+                fun(*(T*) (rg.begin + idx * sizeof(T)));
+            }
+        }
+    }
+
+    // call FUN(T&) for every live object, in address order
+    template <typename F>
+    void forEach(const F &fun)
+    {
+        foreach (const Range &rg, getRanges(1))
+            forEachRange(rg, fun);
+    }
+
+    // call FUN(T&) for every live object on the job system. FUN must be safe
+    // to call concurrently on different objects
+    template <typename F>
+    void forEachParallel(const F &fun)
+    {
+        const std::vector<Range> rgs = getRanges(4 * (job_worker_count() + 1));
+        parallel_for(0, (int)rgs.size(), [&](int first, int last) {
+                for (int i=first; i<last; i++)
+                    forEachRange(rgs[i], fun);
+            }, 1);
+    }
+
+    // destroy every live object
+    void clear()
+    {
+        forEach([this](T &obj) { destroy(&obj); });
+    }
+};
+
 template <typename T>
 size_t SizeOf(const T& val) { return sizeof(T); }
 